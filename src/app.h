@@ -19,5 +19,88 @@
  * along with this program; if not, see <http://www.gnu.org/licenses/>.
  *
  */
-extern result_t app_init(uint8_t node_address, status_handler_t handler);
-extern result_t app_main(void);
+#ifndef _APP_H
+#define _APP_H
+
+/*
+ * Application registry. The build configuration defines an APP_xxx switch
+ * for each application linked into the image, and NODE_APPS() expands to
+ * one entry per application:
+ *
+ *     X(name, bit, polled)
+ *
+ * name    prefix of the application's <name>_app_init() and <name>_app_main()
+ * bit     bit in the EEPROM_NODE_APPS_ADDR mask enabling the app at boot
+ * polled  1 if <name>_app_main() has work on every pass of the main loop,
+ *         0 if the application is driven purely by frames and timers, in
+ *         which case <name>_app_main() is never called
+ *
+ * The main loop is generated from the list at compile time, so there are
+ * no function pointers and unpolled applications cost nothing.
+ */
+#ifdef APP_SW_INPUT
+#define APP_LIST_SW_INPUT(X)      X(sw_input,   0, 1)
+#else
+#define APP_LIST_SW_INPUT(X)
+#endif
+
+#if defined(APP_SW_OUTPUT) && defined(NODE_TIME)
+#define APP_LIST_SW_OUTPUT(X)     X(sw_output,  1, 1)      // Timed outputs fall due
+#elif defined(APP_SW_OUTPUT)
+#define APP_LIST_SW_OUTPUT(X)     X(sw_output,  1, 0)
+#else
+#define APP_LIST_SW_OUTPUT(X)
+#endif
+
+#ifdef APP_CONTROLLER
+#define APP_LIST_CONTROLLER(X)    X(controller, 2, 1)
+#else
+#define APP_LIST_CONTROLLER(X)
+#endif
+
+#ifdef APP_ADC
+#define APP_LIST_ADC(X)           X(adc,        3, 1)
+#else
+#define APP_LIST_ADC(X)
+#endif
+
+#ifdef APP_DUMMY
+#define APP_LIST_DUMMY(X)         X(dummy,      7, 0)
+#else
+#define APP_LIST_DUMMY(X)
+#endif
+
+#define NODE_APPS(X)              \
+	APP_LIST_SW_INPUT(X)      \
+	APP_LIST_SW_OUTPUT(X)     \
+	APP_LIST_CONTROLLER(X)    \
+	APP_LIST_ADC(X)           \
+	APP_LIST_DUMMY(X)
+
+#define APP_DECLARE(name, bit, polled)                                              \
+	extern result_t name##_app_init(uint8_t node_address, status_handler_t handler); \
+	extern result_t name##_app_main(void);
+
+NODE_APPS(APP_DECLARE)
+
+/*
+ * Status reported by applications through the status handler they're
+ * given, from the top of the status source range to keep clear of
+ * libesoup's own sources
+ */
+#define APP_STATUS_SOURCE         ((status_source_t)0xff)
+
+enum app_status {
+	app_input_quarantined = 0,     // data input node address
+	app_input_released,            // data input node address
+};
+
+/*
+ * Called at boot, before the CAN Bus is initialised, to put the Switch
+ * Outputs back as they were before the node lost power
+ */
+#if defined(APP_SW_OUTPUT) && defined(SW_OUTPUT_JOURNAL)
+extern result_t sw_output_restore(void);
+#endif
+
+#endif // _APP_H
@@ -0,0 +1,375 @@
+/**
+ * @file application/adc_app.c
+ *
+ * @author John Whitmore
+ *
+ * @brief Application entry points for an ADC Input Board
+ *
+ * Copyright 2018 electronicSoup
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the version 3 of the GNU General Public License
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include "libesoup_config.h"
+#ifdef SYS_SERIAL_LOGGING
+#define DEBUG_FILE
+static const char *TAG = "ADC";
+#include "libesoup/logger/serial_log.h"
+#endif
+#include "libesoup/errno.h"
+#include "libesoup/gpio/gpio.h"
+#ifdef SYS_ADC
+#include "libesoup/gpio/adc/adc.h"
+#endif
+#include "libesoup/timers/sw_timers.h"
+#include "libesoup/comms/can/can.h"
+#include "libesoup/comms/can/es_control/es_control.h"
+#include "libesoup/status/status.h"
+
+#include "node_can.h"
+#include "timer_wheel.h"
+
+/*
+ * Channels are consecutive analog pins from ADC_FIRST_PIN
+ */
+#ifndef ADC_FIRST_PIN
+#define ADC_FIRST_PIN          RB0
+#endif
+
+#define MAX_INTERVAL_SAMPLES   (ADC_MAX_INTERVAL_ms / ADC_SAMPLE_ms)
+
+/*
+ * Frame is the node address followed by up to two [chan, value LE16]
+ */
+#define VALUES_PER_FRAME       2
+
+static uint8_t   node_address;
+
+/*
+ * Conversions complete in interrupt context and are passed to the main
+ * loop through a single producer, single consumer ring
+ */
+struct sample {
+	uint8_t   chan;
+	uint16_t  value;
+};
+
+static struct sample      ring[ADC_RING_SIZE];
+static volatile uint8_t   ring_head = 0;
+static volatile uint8_t   ring_tail = 0;
+static volatile uint16_t  ring_overruns = 0;
+
+struct channel {
+	uint32_t  filter;           // Filtered value << ADC_FILTER_SHIFT
+	uint16_t  reported;
+	uint16_t  since_report;     // Sample periods since the last report
+	uint8_t   seeded:1;
+	uint8_t   pending:1;
+};
+
+static struct channel     channels[ADC_NUM_CHANNELS];
+
+#ifdef TIMER_WHEEL
+static struct wheel_timer sample_timer;
+#endif
+
+#ifdef __RPI
+static uint32_t           frames_sent;
+static uint32_t           naive_frames;
+static uint16_t           periods;
+#endif
+
+static void push_sample(uint8_t chan, uint16_t value)
+{
+	uint8_t next;
+
+	next = (ring_head + 1) % ADC_RING_SIZE;
+	if(next == ring_tail) {
+		ring_overruns++;
+		return;
+	}
+	ring[ring_head].chan  = chan;
+	ring[ring_head].value = value;
+	ring_head = next;
+}
+
+#ifdef SYS_ADC
+/*
+ * Each conversion starts the next, so one timer expiry samples every channel
+ */
+static void conversion_done(enum pin_t pin, uint16_t value)
+{
+	result_t  rc;
+	uint8_t   chan;
+
+	chan = pin - ADC_FIRST_PIN;
+	push_sample(chan, value);
+
+	if(++chan < ADC_NUM_CHANNELS) {
+		rc = adc_sample(ADC_FIRST_PIN + chan, conversion_done);
+		if(rc < 0) ring_overruns++;
+	}
+}
+#endif
+
+#ifdef __RPI
+/*
+ * Host build has no ADC, so simulate a quiet input, a slow ramp, a step
+ * every few seconds and a fast swing, each with a few counts of noise
+ */
+static uint16_t simulate(uint8_t chan, uint16_t period)
+{
+	static uint32_t  seed = 1;
+	int16_t          noise;
+	uint16_t         phase;
+	uint16_t         value;
+
+	seed  = (seed * 1103515245) + 12345;
+	noise = (int16_t)((seed >> 16) % 13) - 6;
+
+	switch(chan % 4) {
+	case 0:
+		value = 2048;
+		break;
+	case 1:
+		value = 1024 + (period % 2048);
+		break;
+	case 2:
+		value = ((period / 300) & 0x01) ? 3000 : 1000;
+		break;
+	default:
+		phase = period % 100;
+		value = 1024 + ((phase < 50) ? phase : 100 - phase) * 40;
+		break;
+	}
+	return(value + noise);
+}
+#endif
+
+#ifdef TIMER_WHEEL
+static void sample_expiry(struct wheel_timer *timer, union sigval data)
+#else
+static void sample_expiry(timer_id timer, union sigval data)
+#endif
+{
+#if defined(SYS_ADC)
+	result_t  rc;
+
+	rc = adc_sample(ADC_FIRST_PIN, conversion_done);
+	if(rc < 0) ring_overruns++;
+#elif defined(__RPI)
+	uint8_t   chan;
+
+	for(chan = 0; chan < ADC_NUM_CHANNELS; chan++) {
+		push_sample(chan, simulate(chan, periods));
+	}
+#endif
+#ifdef __RPI
+	/*
+	 * Periodic reporting would send every channel every sample period
+	 */
+	naive_frames += (ADC_NUM_CHANNELS + VALUES_PER_FRAME - 1) / VALUES_PER_FRAME;
+	if(++periods % (10000 / ADC_SAMPLE_ms) == 0) {
+		LOG_I("%lu frames/s against %lu periodic, %lu%% saved, %d overruns\n\r",
+		      (unsigned long)(frames_sent / 10), (unsigned long)(naive_frames / 10),
+		      (unsigned long)((naive_frames) ? 100 - ((frames_sent * 100) / naive_frames) : 0),
+		      ring_overruns);
+		frames_sent  = 0;
+		naive_frames = 0;
+	}
+#endif
+}
+
+static result_t send_frame(can_frame *frame)
+{
+	result_t  rc;
+	uint8_t   loop;
+	uint8_t   chan;
+
+	rc = node_can_tx_frame(frame);
+	RC_CHECK
+#ifdef __RPI
+	frames_sent++;
+#endif
+	/*
+	 * Channels only count as reported once the frame has gone, otherwise
+	 * they stay pending for the next pass
+	 */
+	for(loop = 1; loop < frame->can_dlc; loop += 3) {
+		chan = frame->data[loop];
+		channels[chan].reported     = frame->data[loop + 1] | (frame->data[loop + 2] << 8);
+		channels[chan].since_report = 0;
+		channels[chan].pending      = 0;
+	}
+	frame->can_dlc = 1;
+	return(0);
+}
+
+static result_t send_pending(void)
+{
+	result_t              rc;
+	uint8_t               chan;
+	uint16_t              value;
+	can_frame             frame;
+	union es_control_id   es_id;
+
+	es_id.word            = 0x0000;
+	es_id.fields.priority = ESC_PRIORITY_3;
+	es_id.fields.es_type  = ESC_ADC_INPUT;
+	frame.can_id          = es_id.word;
+	frame.data[0]         = node_address;
+	frame.can_dlc         = 1;
+
+	for(chan = 0; chan < ADC_NUM_CHANNELS; chan++) {
+		if(!channels[chan].pending) continue;
+
+		value = (uint16_t)(channels[chan].filter >> ADC_FILTER_SHIFT);
+		frame.data[frame.can_dlc++] = chan;
+		frame.data[frame.can_dlc++] = (uint8_t)(value & 0xff);
+		frame.data[frame.can_dlc++] = (uint8_t)(value >> 8);
+
+		if(frame.can_dlc == 1 + (VALUES_PER_FRAME * 3)) {
+			rc = send_frame(&frame);
+			RC_CHECK
+		}
+	}
+
+	if(frame.can_dlc > 1) {
+		rc = send_frame(&frame);
+		RC_CHECK
+	}
+	return(0);
+}
+
+#ifdef SYS_CAN_BUS
+void adc_rtr(can_frame *rx_frame)
+{
+	result_t  rc;
+	uint8_t   chan;
+
+	if((rx_frame->can_dlc < 1) || (rx_frame->data[0] != node_address)) return;
+
+	for(chan = 0; chan < ADC_NUM_CHANNELS; chan++) {
+		if(channels[chan].seeded) channels[chan].pending = 1;
+	}
+	rc = send_pending();
+	RC_CHECK_PRINT_VOID("ADC resp\n\r");
+}
+#endif
+
+result_t adc_app_init(uint8_t address, status_handler_t handler)
+{
+	result_t          rc;
+	uint8_t           chan;
+#ifdef TIMER_WHEEL
+	union sigval      data;
+#else
+	struct timer_req  request;
+#endif
+#ifdef SYS_CAN_BUS
+	can_l2_target_t   target;
+#endif
+
+	LOG_D("app_init(0x%x)\n\r", address);
+
+	node_address = address;
+
+	for(chan = 0; chan < ADC_NUM_CHANNELS; chan++) {
+#ifdef SYS_ADC
+		rc = gpio_set(ADC_FIRST_PIN + chan, GPIO_MODE_ANALOG_INPUT, 0);
+		RC_CHECK
+#endif
+		channels[chan].filter       = 0;
+		channels[chan].reported     = 0;
+		channels[chan].since_report = 0;
+		channels[chan].seeded       = 0;
+		channels[chan].pending      = 0;
+	}
+
+#ifdef SYS_CAN_BUS
+	target.filter  = ESC_RTR_MASK | ESC_ADC_INPUT;
+	target.mask    = ESC_RTR_MASK | ESC_TYPE_MASK;
+	target.handler = adc_rtr;
+	rc = node_can_reg_handler(&target);
+	RC_CHECK
+#endif
+
+#ifdef TIMER_WHEEL
+	data.sival_int = 0;
+	TIMER_WHEEL_INIT(&sample_timer);
+	rc = timer_wheel_start(&sample_timer, ADC_SAMPLE_ms, TRUE, sample_expiry, data);
+	RC_CHECK
+#else
+	request.period.units    = mSeconds;
+	request.period.duration = ADC_SAMPLE_ms;
+	request.type            = repeat;
+	request.exp_fn          = sample_expiry;
+	request.data.sival_int  = 0;
+	rc = sw_timer_start(&request);
+	RC_CHECK
+#endif
+	return(0);
+}
+
+/*
+ * Filters the samples taken since the last pass, then reports channels
+ * which have left the deadband around the last value sent, or have not
+ * been reported for ADC_MAX_INTERVAL_ms, in as few frames as possible
+ */
+result_t adc_app_main(void)
+{
+	result_t         rc;
+	uint8_t          chan;
+	uint8_t          any = 0;
+	uint16_t         value;
+	struct sample   *sample;
+	struct channel  *channel;
+
+	while(ring_tail != ring_head) {
+		sample  = &ring[ring_tail];
+		channel = &channels[sample->chan];
+
+		if(!channel->seeded) {
+			channel->filter  = (uint32_t)sample->value << ADC_FILTER_SHIFT;
+			channel->seeded  = 1;
+			channel->pending = 1;
+		} else {
+			channel->filter -= channel->filter >> ADC_FILTER_SHIFT;
+			channel->filter += sample->value;
+		}
+		channel->since_report++;
+		ring_tail = (ring_tail + 1) % ADC_RING_SIZE;
+	}
+
+	for(chan = 0; chan < ADC_NUM_CHANNELS; chan++) {
+		channel = &channels[chan];
+		if(!channel->seeded) continue;
+
+		value = (uint16_t)(channel->filter >> ADC_FILTER_SHIFT);
+		if((value > channel->reported + ADC_DEADBAND)
+		    || (value + ADC_DEADBAND < channel->reported)
+		    || (channel->since_report >= MAX_INTERVAL_SAMPLES)) {
+			channel->pending = 1;
+		}
+		any |= channel->pending;
+	}
+
+	/*
+	 * A busy bus isn't a reason to stop the application, unsent values
+	 * are retried on the next pass
+	 */
+	if(any) {
+		rc = send_pending();
+		RC_CHECK_PRINT_CONT("ADC report\n\r");
+	}
+	return(0);
+}
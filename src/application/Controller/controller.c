@@ -32,159 +32,1200 @@ static const char *TAG = "Master";
 #include "libesoup/status/status.h"
 #include "libesoup/timers/sw_timers.h"
 
+#include "app.h"
+#include "node_ticks.h"
+#include "node_can.h"
+#include "node_groups.h"
+#include "node_jobs.h"
+#include "node_time.h"
+#include "node_trace.h"
+#include "timer_wheel.h"
+
+#ifndef TIMER_WHEEL
+#error "Controller scenes run on the timer wheel"
+#endif
 
 static uint8_t   node_address;
 
-void node1_chan0_bool431_input(uint8_t data)
+/*
+ * Scenes
+ *
+ * A scene is a table of steps, each setting one Boolean output. A step's
+ * delay is counted from the step before it, in SCENE_TICK_ms units, so a
+ * run of zero delays happens at one instant. Outputs due at the same
+ * instant, from any number of scenes, are collected and sent together in
+ * as few frames as possible by controller_app_main().
+ *
+ * A group step sets every channel in an output group, see node_groups.h,
+ * with a single byte on the bus. The Controller's group table says which
+ * channels are in each group. It's sent to the nodes when the Controller
+ * starts driving the outputs, and to a node on its asking as it starts,
+ * and without NODE_GROUPS group steps are sent channel by channel instead.
+ * Nodes keep a group the table no longer has until sent it with an empty
+ * mask, so a group dropped from the table stays as a zero mask member
+ * until every node has seen it.
+ *
+ * Triggers map a Boolean input to the scene it starts and, optionally, a
+ * scene it stops. Starting a scene which is already running restarts it.
+ *
+ * The tables are const so live in program memory.
+ */
+#define SCENE_NONE             0xff
+#define SCENE_DELAY(ms)        ((ms) / SCENE_TICK_ms)
+
+struct scene_step {
+	uint16_t  delay;
+	uint8_t   node:4;
+	uint8_t   chan:3;
+	uint8_t   value:1;
+	uint8_t   group;
+};
+
+struct scene {
+	const struct scene_step  *steps;
+	uint8_t                   num_steps;
+	uint8_t                   repeat;
+};
+
+struct scene_trigger {
+	uint8_t   node:4;
+	uint8_t   chan:3;
+	uint8_t   value:1;
+	uint8_t   start;
+	uint8_t   stop;
+};
+
+struct group_member {
+	uint8_t   group;
+	uint8_t   node;
+	uint8_t   mask;
+};
+
+#define STEP(ms, node, chan, value)      { SCENE_DELAY(ms), node, chan, value, NODE_GROUP_NONE }
+#define GROUP_STEP(ms, group, value)     { SCENE_DELAY(ms), 0, 0, value, group }
+#define SCENE(steps, repeat)             { steps, sizeof(steps) / sizeof(struct scene_step), repeat }
+
+enum {
+	GROUP_NODE1,
+	GROUP_NODE2,
+	GROUP_ALL,
+};
+
+static const struct group_member group_members[] = {
+	{ GROUP_NODE1, 0x01, 0xff },
+	{ GROUP_NODE2, 0x02, 0xff },
+	{ GROUP_ALL,   0x00, 0xff }, { GROUP_ALL, 0x01, 0xff }, { GROUP_ALL, 0x02, 0xff }, { GROUP_ALL, 0x03, 0xff },
+	{ GROUP_ALL,   0x04, 0xff }, { GROUP_ALL, 0x05, 0xff }, { GROUP_ALL, 0x06, 0xff }, { GROUP_ALL, 0x07, 0xff },
+	{ GROUP_ALL,   0x08, 0xff }, { GROUP_ALL, 0x09, 0xff }, { GROUP_ALL, 0x0a, 0xff }, { GROUP_ALL, 0x0b, 0xff },
+	{ GROUP_ALL,   0x0c, 0xff }, { GROUP_ALL, 0x0d, 0xff }, { GROUP_ALL, 0x0e, 0xff }, { GROUP_ALL, 0x0f, 0xff },
+};
+
+#define NUM_GROUP_MEMBERS   (sizeof(group_members) / sizeof(struct group_member))
+
+static const struct scene_step node1_all_on[] = {
+	GROUP_STEP(0, GROUP_NODE1, 1),
+};
+
+static const struct scene_step node1_all_off[] = {
+	GROUP_STEP(0, GROUP_NODE1, 0),
+};
+
+static const struct scene_step node2_all_on[] = {
+	GROUP_STEP(0, GROUP_NODE2, 1),
+};
+
+static const struct scene_step node2_all_off[] = {
+	GROUP_STEP(0, GROUP_NODE2, 0),
+};
+
+/*
+ * Every output on every node off
+ */
+static const struct scene_step all_off[] = {
+	GROUP_STEP(0, GROUP_ALL, 0),
+};
+
+/*
+ * Node 3's outputs on in turn, 200mS apart, then all off after 10 minutes
+ */
+static const struct scene_step node3_stairs[] = {
+	STEP(0,   0x03, 0, 1), STEP(200, 0x03, 1, 1), STEP(200, 0x03, 2, 1), STEP(200, 0x03, 3, 1),
+	STEP(200, 0x03, 4, 1), STEP(200, 0x03, 5, 1), STEP(200, 0x03, 6, 1), STEP(200, 0x03, 7, 1),
+	STEP(600000UL, 0x03, 0, 0), STEP(0, 0x03, 1, 0), STEP(0, 0x03, 2, 0), STEP(0, 0x03, 3, 0),
+	STEP(0,   0x03, 4, 0), STEP(0,   0x03, 5, 0), STEP(0,   0x03, 6, 0), STEP(0,   0x03, 7, 0),
+};
+
+enum {
+	NODE1_ALL_ON,
+	NODE1_ALL_OFF,
+	NODE2_ALL_ON,
+	NODE2_ALL_OFF,
+	NODE3_STAIRS,
+	ALL_OFF,
+#ifdef SCENE_BENCH
+	BENCH_SCENE,
+#endif
+	NUM_SCENES
+};
+
+#ifdef SCENE_BENCH
+static const struct scene_step bench_steps[] = {
+	STEP(50,  0x0f, 0, 1), STEP(0,   0x0f, 1, 1), STEP(100, 0x0f, 0, 0), STEP(0, 0x0f, 1, 0),
+	STEP(150, 0x0f, 2, 1), STEP(200, 0x0f, 2, 0), STEP(50,  0x0f, 3, 1), STEP(50, 0x0f, 3, 0),
+};
+#endif
+
+static const struct scene scenes[NUM_SCENES] = {
+	SCENE(node1_all_on,  0),
+	SCENE(node1_all_off, 0),
+	SCENE(node2_all_on,  0),
+	SCENE(node2_all_off, 0),
+	SCENE(node3_stairs,  0),
+	SCENE(all_off,       0),
+#ifdef SCENE_BENCH
+	SCENE(bench_steps,   1),
+#endif
+};
+
+static const struct scene_trigger triggers[] = {
+	{ 0x01, 0, 1, NODE1_ALL_ON,  NODE1_ALL_OFF },
+	{ 0x01, 0, 0, NODE1_ALL_OFF, NODE1_ALL_ON  },
+	{ 0x01, 1, 1, NODE2_ALL_ON,  NODE2_ALL_OFF },
+	{ 0x01, 1, 0, NODE2_ALL_OFF, NODE2_ALL_ON  },
+	{ 0x01, 2, 1, NODE3_STAIRS,  SCENE_NONE    },
+	{ 0x01, 3, 1, ALL_OFF,       NODE3_STAIRS  },
+#ifdef CONTROLLER_RATE_BENCH
+	{ 0x0e, 0, 1, ALL_OFF,       NODE3_STAIRS  },
+	{ 0x0e, 0, 0, NODE1_ALL_ON,  NODE1_ALL_OFF },
+#endif
+};
+
+#define NUM_TRIGGERS   (sizeof(triggers) / sizeof(struct scene_trigger))
+
+/*
+ * A scene runs at most once at a time, so each has its own run, indexed
+ * by scene number. scene is SCENE_NONE while it isn't running.
+ */
+struct scene_run {
+	struct wheel_timer  timer;
+	uint8_t             scene;
+	uint8_t             step;
+};
+
+static struct scene_run   runs[NUM_SCENES];
+
+/*
+ * Outputs due this pass of the main loop. Group outputs are sent ahead of
+ * single outputs due at the same instant.
+ */
+static can_frame          pending;
+#ifdef NODE_GROUPS
+static can_frame          pending_groups;
+#ifdef NODE_JOBS
+static struct node_job    groups_job;
+#endif
+#endif
+#if defined(SCENE_BENCH) || defined(CONTROLLER_RATE_BENCH)
+#define BENCH_DRY
+static boolean            bench_dry = FALSE;
+static uint32_t           bench_frames;
+#endif
+#ifdef CONTROLLER_RATE_BENCH
+#define BENCH_QUEUE_SIZE       64
+static can_frame          bench_queue[BENCH_QUEUE_SIZE];     // Waiting for the bench bus
+static uint8_t            bench_queue_head;
+static uint8_t            bench_queue_tail;
+static uint32_t           bench_lost;
+#endif
+
+#ifdef CONTROLLER_HOT_STANDBY
+/*
+ * Hot standby
+ *
+ * Every Controller receives the same input frames and runs the same scene
+ * tables, so a standby keeps its scenes in step with the primary's simply
+ * by running them, with its outputs dropped rather than sent. Output
+ * state is mirrored from the primary's output frames as they pass. Nothing
+ * extra is sent to keep a standby up to date.
+ *
+ * Outputs a standby drops are mirrored too, and marked unsent until the
+ * primary is seen sending them. Those left unsent when it takes over, set
+ * by scenes while the primary was silent, are sent then.
+ *
+ * The primary sends a heartbeat every CONTROLLER_HEARTBEAT_ms period in
+ * which it has sent no outputs, and every CONTROLLER_HEARTBEAT_BUSY periods
+ * regardless. Output frames can't be told from a Switch Output node's own
+ * replies, so a standby only counts heartbeats, taking over once it has
+ * heard none for CONTROLLER_FAILOVER_MISSED periods. Controllers boot as
+ * standby, so a Controller restarting doesn't fight a running primary, and
+ * if two primaries hear each other the one with the higher node address
+ * stands down, within CONTROLLER_HEARTBEAT_BUSY periods however busy.
+ */
+#if CONTROLLER_HEARTBEAT_BUSY >= CONTROLLER_FAILOVER_MISSED
+#error "A busy primary must send a heartbeat before its standby takes over"
+#endif
+
+#define ROLE_STANDBY           0
+#define ROLE_PRIMARY           1
+
+static uint8_t            role;
+static struct wheel_timer role_timer;
+static boolean            outputs_sent;     // By the primary this period
+static uint8_t            heartbeat_age;    // Periods since the last sent
+static uint8_t            outputs[16];      // Bit per channel, by node
+static uint8_t            unsent[16];       // Dropped, not seen from the primary
+
+static void role_expiry(struct wheel_timer *timer, union sigval data);
+
+static void role_timer_restart(void)
 {
-	result_t               rc;
-	union bool_431         es_bool_in;
-	union bool_431         es_bool_out;
-	uint8_t                loop;
-	can_frame              tx_frame;
-	union es_control_id    es_ctrl_id;
+	union sigval  data;
+	uint32_t      duration;
 
-	es_bool_in.byte  = data;
+	data.sival_int = 0;
+	duration = CONTROLLER_HEARTBEAT_ms;
+	if(role == ROLE_STANDBY) duration *= CONTROLLER_FAILOVER_MISSED;
+	timer_wheel_start(&role_timer, duration, FALSE, role_expiry, data);
+}
 
-	/*
-	 * Create a frame with the current status of the inputs
-	 */
-	es_ctrl_id.word = 0;
-	es_ctrl_id.fields.es_type = ESC_BOOL_431_OUTPUT;
+static void mirror_output(uint8_t node, uint8_t mask, uint8_t value, boolean dropped)
+{
+	uint8_t  changed;
 
-	tx_frame.can_id  = es_ctrl_id.word;
-	tx_frame.can_dlc = 0;
-	
-	if (es_bool_in.bitfield.es_bool) {
-		es_bool_out.bitfield.node = 0x01;
-		es_bool_out.bitfield.es_bool = 0b1;
-
-		for (loop = 0; loop < 8; loop++) {
-			es_bool_out.bitfield.chan = loop;
-			tx_frame.data[tx_frame.can_dlc++] = es_bool_out.byte;
-
-			if(tx_frame.can_dlc == 8) {
-				rc = can_l2_tx_frame(&tx_frame);
-				RC_CHECK_PRINT_VOID("CAN Tx\n\r");
-				tx_frame.can_dlc = 0;
-			}
-		}
+	changed = (value) ? (mask & ~outputs[node]) : (mask & outputs[node]);
+	if(value) {
+		outputs[node] |= mask;
+	} else {
+		outputs[node] &= ~mask;
+	}
+	if(dropped) {
+		unsent[node] |= changed;
 	} else {
-		es_bool_out.bitfield.node = 0x01;
-		es_bool_out.bitfield.es_bool = 0b0;
+		unsent[node] &= ~mask;
+	}
+}
 
-		for (loop = 0; loop < 8; loop++) {
-			es_bool_out.bitfield.chan = loop;
-			tx_frame.data[tx_frame.can_dlc++] = es_bool_out.byte;
+static void mirror_outputs(can_frame *frame, boolean dropped)
+{
+	uint8_t         loop = 0;
+	uint8_t         member;
+	union bool_431  es_bool;
 
-			if(tx_frame.can_dlc == 8) {
-				rc = can_l2_tx_frame(&tx_frame);
-				RC_CHECK_PRINT_VOID("CAN Tx\n\r");
-				tx_frame.can_dlc = 0;
+	/*
+	 * Group outputs are mirrored through the group table
+	 */
+	if((frame->can_id & ESC_TYPE_MASK) == ESC_GROUP_OUTPUT) {
+		for(; loop < frame->can_dlc; loop++) {
+			for(member = 0; member < NUM_GROUP_MEMBERS; member++) {
+				if(group_members[member].group != (frame->data[loop] & NODE_GROUP_MASK)) continue;
+				mirror_output(group_members[member].node, group_members[member].mask,
+				              frame->data[loop] & NODE_GROUP_VALUE, dropped);
 			}
-		}					
+		}
+		return;
 	}
 
-	if(tx_frame.can_dlc > 0) {
-		rc = can_l2_tx_frame(&tx_frame);
-		RC_CHECK_PRINT_VOID("CAN Tx\n\r");
-		tx_frame.can_dlc = 0;
+	/*
+	 * Timed outputs are mirrored as they're sent, not when they're set
+	 */
+	if((frame->can_id & ESC_TYPE_MASK) == ESC_TIMED_OUTPUT) loop = NODE_TIME_OUTPUT_OFFSET;
+
+	for(; loop < frame->can_dlc; loop++) {
+		es_bool.byte = frame->data[loop];
+		mirror_output(es_bool.bitfield.node, 1 << es_bool.bitfield.chan, es_bool.bitfield.es_bool, dropped);
 	}
 }
+#define OUTPUTS_SENT()         (outputs_sent = TRUE)
+#else
+#define OUTPUTS_SENT()
+#define mirror_outputs(frame, dropped)
+#endif // CONTROLLER_HOT_STANDBY
 
-void node1_chan1_bool431_input(uint8_t data)
+#ifdef NODE_TIME
+/*
+ * Outputs due together are sent to be set at one bus time, far enough
+ * ahead for every frame to get across the bus, so they switch together
+ * however many frames and nodes they're spread over
+ */
+static result_t send_outputs(void)
 {
 	result_t               rc;
-	union bool_431         es_bool_in;
-	union bool_431         es_bool_out;
 	uint8_t                loop;
-	can_frame              tx_frame;
+	uint32_t               at;
+	can_frame              frame;
 	union es_control_id    es_ctrl_id;
 
-	es_bool_in.byte  = data;
+	if(!node_time_synced()) return(node_can_tx_frame(&pending));
+
+	at = node_time_now() + ((uint32_t)CONTROLLER_OUTPUT_LEAD_ms * 1000);
 
-	/*
-	 * Create a frame with the current status of the inputs
-	 */
 	es_ctrl_id.word = 0;
-	es_ctrl_id.fields.es_type = ESC_BOOL_431_OUTPUT;
-	
-	tx_frame.can_id  = es_ctrl_id.word;
-	tx_frame.can_dlc = 0;
-	
-	if (es_bool_in.bitfield.es_bool) {
-		es_bool_out.bitfield.node = 0x02;
-		es_bool_out.bitfield.es_bool = 0b1;
-
-		for (loop = 0; loop < 8; loop++) {
-			es_bool_out.bitfield.chan = loop;
-			tx_frame.data[tx_frame.can_dlc++] = es_bool_out.byte;
-
-			if(tx_frame.can_dlc == 8) {
-				rc = can_l2_tx_frame(&tx_frame);
-				RC_CHECK_PRINT_VOID("CAN Tx\n\r");
-				tx_frame.can_dlc = 0;
+	es_ctrl_id.fields.es_type = ESC_TIMED_OUTPUT;
+	frame.can_id  = es_ctrl_id.word;
+	frame.data[0] = (uint8_t)(at & 0xff);
+	frame.data[1] = (uint8_t)((at >> 8) & 0xff);
+	frame.data[2] = (uint8_t)((at >> 16) & 0xff);
+	frame.data[3] = (uint8_t)((at >> 24) & 0xff);
+	frame.can_dlc = NODE_TIME_OUTPUT_OFFSET;
+
+	for(loop = 0; loop < pending.can_dlc; loop++) {
+		frame.data[frame.can_dlc++] = pending.data[loop];
+		if((frame.can_dlc == 8) || (loop == pending.can_dlc - 1)) {
+			rc = node_can_tx_frame(&frame);
+			RC_CHECK
+			frame.can_dlc = NODE_TIME_OUTPUT_OFFSET;
+		}
+	}
+	return(0);
+}
+#else
+#define send_outputs()    node_can_tx_frame(&pending)
+#endif // NODE_TIME
+
+#ifdef BENCH_DRY
+static void bench_out(can_frame *frame)
+{
+	bench_frames++;
+#ifdef CONTROLLER_RATE_BENCH
+	if(((bench_queue_head + 1) % BENCH_QUEUE_SIZE) == bench_queue_tail) {
+		bench_lost++;
+		return;
+	}
+	bench_queue[bench_queue_head] = *frame;
+	bench_queue_head = (bench_queue_head + 1) % BENCH_QUEUE_SIZE;
+#endif
+}
+#endif // BENCH_DRY
+
+#ifdef NODE_GROUPS
+#define pending_groups_dlc()    (pending_groups.can_dlc)
+#else
+#define pending_groups_dlc()    0
+#endif
+
+static void flush_outputs(void)
+{
+	result_t  rc;
+
+	if((pending.can_dlc == 0) && (pending_groups_dlc() == 0)) return;
+
+#ifdef BENCH_DRY
+	if(bench_dry) {
+#ifdef NODE_GROUPS
+		if(pending_groups.can_dlc) bench_out(&pending_groups);
+#endif
+		if(pending.can_dlc) bench_out(&pending);
+		pending.can_dlc = 0;
+#ifdef NODE_GROUPS
+		pending_groups.can_dlc = 0;
+#endif
+		return;
+	}
+#endif
+#ifdef CONTROLLER_HOT_STANDBY
+	if(role == ROLE_STANDBY) {
+#ifdef NODE_GROUPS
+		mirror_outputs(&pending_groups, TRUE);
+		pending_groups.can_dlc = 0;
+#endif
+		mirror_outputs(&pending, TRUE);
+		pending.can_dlc = 0;
+		return;
+	}
+#endif
+#ifdef NODE_GROUPS
+	if(pending_groups.can_dlc) {
+		rc = node_can_tx_frame(&pending_groups);
+		if(rc >= 0) {
+			mirror_outputs(&pending_groups, FALSE);
+			OUTPUTS_SENT();
+		}
+		pending_groups.can_dlc = 0;
+		RC_CHECK_PRINT_CONT("CAN Tx\n\r");
+	}
+	if(pending.can_dlc == 0) return;
+#endif
+	rc = send_outputs();
+	if(rc >= 0) {
+		mirror_outputs(&pending, FALSE);
+		OUTPUTS_SENT();
+	}
+	pending.can_dlc = 0;
+	RC_CHECK_PRINT_VOID("CAN Tx\n\r");
+}
+
+static void queue_bool(uint8_t node, uint8_t chan, uint8_t value)
+{
+	union bool_431  es_bool;
+
+	es_bool.byte             = 0x00;
+	es_bool.bitfield.node    = node;
+	es_bool.bitfield.chan    = chan;
+	es_bool.bitfield.es_bool = value;
+
+	pending.data[pending.can_dlc++] = es_bool.byte;
+	if(pending.can_dlc == 8) flush_outputs();
+}
+
+static void queue_group(uint8_t group, uint8_t value)
+{
+#ifdef NODE_GROUPS
+	pending_groups.data[pending_groups.can_dlc++] = NODE_GROUP_BYTE(group, value);
+	if(pending_groups.can_dlc == 8) flush_outputs();
+#else
+	uint8_t  member;
+	uint8_t  chan;
+
+	for(member = 0; member < NUM_GROUP_MEMBERS; member++) {
+		if(group_members[member].group != group) continue;
+		for(chan = 0; chan < 8; chan++) {
+			if(group_members[member].mask & (1 << chan)) queue_bool(group_members[member].node, chan, value);
+		}
+	}
+#endif
+}
+
+static void queue_output(const struct scene_step *step)
+{
+	if(step->group == NODE_GROUP_NONE) {
+		queue_bool(step->node, step->chan, step->value);
+	} else {
+		queue_group(step->group, step->value);
+	}
+}
+
+#ifdef NODE_GROUPS
+static result_t group_config_send(const struct group_member *member)
+{
+	can_frame              frame;
+	union es_control_id    es_ctrl_id;
+
+	es_ctrl_id.word = 0;
+	es_ctrl_id.fields.priority = ESC_PRIORITY_3;
+	es_ctrl_id.fields.es_type  = ESC_GROUP_CONFIG;
+
+	frame.can_id  = es_ctrl_id.word;
+	frame.can_dlc = 3;
+	frame.data[0] = member->node;
+	frame.data[1] = member->group;
+	frame.data[2] = member->mask;
+	return(node_can_tx_frame(&frame));
+}
+
+/*
+ * Members still to be sent, a bit each
+ */
+static uint8_t            members_pending[(NUM_GROUP_MEMBERS + 7) / 8];
+
+#define MEMBER_PENDING(member)    (members_pending[(member) >> 3] & (1 << ((member) & 0x07)))
+
+#ifdef NODE_JOBS
+/*
+ * A frame per pass, so the group table doesn't flood the bus
+ */
+static uint8_t groups_send_job(struct node_job *job)
+{
+	result_t  rc;
+	uint8_t   member;
+
+	for(member = 0; member < NUM_GROUP_MEMBERS; member++) {
+		if(MEMBER_PENDING(member)) break;
+	}
+	if(member == NUM_GROUP_MEMBERS) return(NODE_JOB_DONE);
+
+	members_pending[member >> 3] &= ~(1 << (member & 0x07));
+	rc = group_config_send(&group_members[member]);
+	RC_CHECK_PRINT_CONT("Group config\n\r");
+	return(NODE_JOB_YIELD);
+}
+#endif
+
+static void groups_flush(void)
+{
+	result_t      rc;
+#ifdef NODE_JOBS
+	union sigval  data;
+
+	data.sival_int = 0;
+	rc = node_job_submit(&groups_job, NODE_JOB_LOW, groups_send_job, data);
+	RC_CHECK_PRINT_VOID("Groups job\n\r");
+#else
+	uint8_t       member;
+
+	for(member = 0; member < NUM_GROUP_MEMBERS; member++) {
+		if(!MEMBER_PENDING(member)) continue;
+		members_pending[member >> 3] &= ~(1 << (member & 0x07));
+		rc = group_config_send(&group_members[member]);
+		RC_CHECK_PRINT_CONT("Group config\n\r");
+	}
+#endif
+}
+
+/*
+ * Nodes only write a group to EEPROM when it changes, so the table is
+ * sent in full whenever the Controller starts driving the outputs
+ */
+static void groups_send(void)
+{
+	uint8_t  member;
+
+	for(member = 0; member < NUM_GROUP_MEMBERS; member++) {
+		members_pending[member >> 3] |= (1 << (member & 0x07));
+	}
+	groups_flush();
+}
+
+/*
+ * A Switch Output node asks for its own groups, an RTR with just its
+ * address, as it starts. Answered by the primary alone.
+ */
+static void groups_request(can_frame *frame)
+{
+	uint8_t  member;
+
+	if(frame->can_dlc != 1) return;
+#ifdef CONTROLLER_HOT_STANDBY
+	if(role != ROLE_PRIMARY) return;
+#endif
+	for(member = 0; member < NUM_GROUP_MEMBERS; member++) {
+		if(group_members[member].node == frame->data[0]) {
+			members_pending[member >> 3] |= (1 << (member & 0x07));
+		}
+	}
+	groups_flush();
+}
+#endif // NODE_GROUPS
+
+static void scene_expiry(struct wheel_timer *timer, union sigval data);
+
+/*
+ * Carry out the run's current step and any following it at the same
+ * instant, then wait on the wheel for the next
+ */
+static void run_steps(struct scene_run *run)
+{
+	const struct scene  *scene = &scenes[run->scene];
+	union sigval         data;
+
+	do {
+		queue_output(&scene->steps[run->step]);
+
+		if(++run->step == scene->num_steps) {
+			if(!scene->repeat) {
+				run->scene = SCENE_NONE;
+				return;
 			}
+			run->step = 0;
+			break;
 		}
+	} while(scene->steps[run->step].delay == 0);
+
+	data.sival_int = run - runs;
+	timer_wheel_start(&run->timer, (uint32_t)scene->steps[run->step].delay * SCENE_TICK_ms, FALSE, scene_expiry, data);
+}
+
+static void scene_expiry(struct wheel_timer *timer, union sigval data)
+{
+	run_steps(&runs[data.sival_int]);
+}
+
+static void run_start(struct scene_run *run, uint8_t scene)
+{
+	union sigval  data;
+
+	run->scene = scene;
+	run->step  = 0;
+
+	if(scenes[scene].steps[0].delay == 0) {
+		run_steps(run);
 	} else {
-		es_bool_out.bitfield.node = 0x02;
-		es_bool_out.bitfield.es_bool = 0b0;
+		data.sival_int = run - runs;
+		timer_wheel_start(&run->timer, (uint32_t)scenes[scene].steps[0].delay * SCENE_TICK_ms, FALSE, scene_expiry, data);
+	}
+}
+
+static void scene_stop(uint8_t scene)
+{
+	timer_wheel_cancel(&runs[scene].timer);
+	runs[scene].scene = SCENE_NONE;
+}
+
+static void scene_start(uint8_t scene)
+{
+	timer_wheel_cancel(&runs[scene].timer);
+	run_start(&runs[scene], scene);
+}
+
+static void scene_trigger(union bool_431 es_bool)
+{
+	uint8_t  loop;
+
+	for(loop = 0; loop < NUM_TRIGGERS; loop++) {
+		if((triggers[loop].node == es_bool.bitfield.node)
+		    && (triggers[loop].chan == es_bool.bitfield.chan)
+		    && (triggers[loop].value == es_bool.bitfield.es_bool)) {
+			if(triggers[loop].stop != SCENE_NONE) scene_stop(triggers[loop].stop);
+			scene_start(triggers[loop].start);
+		}
+	}
+}
+
+#ifdef SCENE_BENCH
+/*
+ * Time spent per second in the main loop passes which moved the wheel on,
+ * against the number of scenes running. Each run is borrowed for the bench
+ * scene. Frames are counted, not sent.
+ */
+static void scene_bench(void)
+{
+	uint16_t      active;
+	uint16_t      loop;
+	node_ticks_t  start;
+	node_ticks_t  pass;
+	node_ticks_t  busy;
+	uint32_t      tick;
+
+	bench_dry = TRUE;
+
+	for(active = 0; active <= NUM_SCENES; active = (active) ? active * 2 : 1) {
+		for(loop = 0; loop < active; loop++) {
+			run_start(&runs[loop], BENCH_SCENE);
+		}
+		bench_frames = 0;
+		busy         = 0;
+		start        = node_ticks();
+		while((node_ticks_t)(node_ticks() - start) < (node_ticks_t)(1000 * NODE_TICKS_PER_ms)) {
+			asm ("CLRWDT");
+			pass = node_ticks();
+			tick = timer_wheel_now();
+			timer_wheel_tasks();
+			flush_outputs();
+			if(timer_wheel_now() != tick) busy += node_ticks() - pass;
+		}
+		for(loop = 0; loop < active; loop++) {
+			timer_wheel_cancel(&runs[loop].timer);
+			runs[loop].scene = SCENE_NONE;
+		}
+		LOG_I("%d scenes: %lu ticks/s busy, %lu frames\n\r", active, (unsigned long)busy, (unsigned long)bench_frames);
+	}
+	bench_dry = FALSE;
+}
+#endif // SCENE_BENCH
+
+#ifdef CONTROLLER_HOT_STANDBY
+static void role_change(uint8_t new_role)
+{
+	uint8_t  loop;
+	uint8_t  chan;
+	uint8_t  bits;
+	uint8_t  on = 0;
+	uint8_t  resent = 0;
 
-		for (loop = 0; loop < 8; loop++) {
-			es_bool_out.bitfield.chan = loop;
-			tx_frame.data[tx_frame.can_dlc++] = es_bool_out.byte;
+	role = new_role;
+	NODE_TRACE_POINT(TRACE_CTRL_ROLE, role, 0);
 
-			if(tx_frame.can_dlc == 8) {
-				rc = can_l2_tx_frame(&tx_frame);
-				RC_CHECK_PRINT_VOID("CAN Tx\n\r");
-				tx_frame.can_dlc = 0;
+	for(loop = 0; loop < 16; loop++) {
+		for(bits = outputs[loop]; bits; bits &= bits - 1) on++;
+
+		if(role == ROLE_PRIMARY) {
+			for(chan = 0; chan < 8; chan++) {
+				if(!(unsent[loop] & (1 << chan))) continue;
+				queue_bool(loop, chan, (outputs[loop] >> chan) & 0x01);
+				resent++;
 			}
-		}					
+		}
+		unsent[loop] = 0x00;
 	}
+	LOG_I("%s, %d outputs on, %d resent\n\r", (role == ROLE_PRIMARY) ? "Primary" : "Standby", on, resent);
+#ifdef NODE_GROUPS
+	if(role == ROLE_PRIMARY) groups_send();
+#endif
+}
 
-	if(tx_frame.can_dlc > 0) {
-		rc = can_l2_tx_frame(&tx_frame);
-		RC_CHECK_PRINT_VOID("CAN Tx\n\r");
-		tx_frame.can_dlc = 0;
+static void heartbeat_send(void)
+{
+	result_t               rc;
+	can_frame              frame;
+	union es_control_id    es_ctrl_id;
+
+	es_ctrl_id.word = 0;
+	es_ctrl_id.fields.priority = ESC_PRIORITY_3;
+	es_ctrl_id.fields.es_type  = ESC_CONTROLLER_HEARTBEAT;
+
+	frame.can_id  = es_ctrl_id.word;
+	frame.can_dlc = 2;
+	frame.data[0] = node_address;
+	frame.data[1] = role;
+	heartbeat_age = 0;
+	rc = node_can_tx_frame(&frame);
+	RC_CHECK_PRINT_VOID("Heartbeat\n\r");
+}
+
+/*
+ * Primary: a heartbeat period has passed. Standby: primary silent
+ */
+static void role_expiry(struct wheel_timer *timer, union sigval data)
+{
+	if(role == ROLE_STANDBY) {
+		role_change(ROLE_PRIMARY);
+		heartbeat_send();
+	} else if(!outputs_sent || (++heartbeat_age >= CONTROLLER_HEARTBEAT_BUSY)) {
+		heartbeat_send();
 	}
+	outputs_sent = FALSE;
+	role_timer_restart();
 }
 
-void node1_bool431_input(uint8_t data)
+static void heartbeat_rx(can_frame *frame)
 {
-	union bool_431  es_bool_in;
+	if((frame->can_dlc < 2) || (frame->data[0] == node_address)) return;
 
-	es_bool_in.byte = data;
-	
-	if (es_bool_in.bitfield.chan == 0x00) {
-		node1_chan0_bool431_input(data);
-	} else if (es_bool_in.bitfield.chan == 0x01) {
-		node1_chan1_bool431_input(data);
+	if(role == ROLE_PRIMARY) {
+		if((frame->data[1] == ROLE_PRIMARY) && (frame->data[0] < node_address)) {
+			role_change(ROLE_STANDBY);
+			role_timer_restart();
+		}
+	} else if(frame->data[1] == ROLE_PRIMARY) {
+		role_timer_restart();
 	}
 }
 
+static void output_rx(can_frame *frame)
+{
+	mirror_outputs(frame, FALSE);
+}
+#endif // CONTROLLER_HOT_STANDBY
+
+#ifdef CONTROLLER_RATE_LIMIT
+/*
+ * Input rate limit
+ *
+ * A chattering switch or a faulty node would otherwise keep the Controller
+ * busy, and the bus full, with the scenes its inputs trigger. Each input
+ * node has a token bucket refilled at CONTROLLER_INPUT_RATE, an input
+ * costing a token or being dropped if there isn't one. Buckets are held
+ * by node address, so the check costs the same however many nodes there
+ * are. Quarantine and release are reported through the status handler.
+ */
+#define TOKEN_ms               (1000 / CONTROLLER_INPUT_RATE)
+
+struct input_source {
+	uint32_t  stamp;             // Last refill, or end of quarantine
+	uint8_t   tokens;
+	uint8_t   drops;
+	uint8_t   quarantined;
+};
+
+static struct input_source  sources[16];
+static status_handler_t     status_handler;
+#ifdef CONTROLLER_RATE_BENCH
+static boolean              bench_unlimited = FALSE;
+static uint32_t             bench_inputs[16];
+#endif
+
+static void input_sources_init(void)
+{
+	uint8_t   loop;
+	uint32_t  now;
+
+	now = timer_wheel_now() * TIMER_WHEEL_TICK_ms;
+	for(loop = 0; loop < 16; loop++) {
+		sources[loop].stamp       = now;
+		sources[loop].tokens      = CONTROLLER_INPUT_BURST;
+		sources[loop].drops       = 0;
+		sources[loop].quarantined = FALSE;
+	}
+}
+
+static void input_source_status(uint8_t node, uint8_t status)
+{
+	NODE_TRACE_POINT(TRACE_CTRL_QUARANTINE, node, (status == app_input_quarantined));
+	if(status_handler) status_handler(APP_STATUS_SOURCE, status, node);
+}
+
+static boolean input_allowed(uint8_t node)
+{
+	struct input_source  *source = &sources[node];
+	uint32_t              now;
+	uint32_t              refill;
+
+#ifdef CONTROLLER_RATE_BENCH
+	if(bench_unlimited) return(TRUE);
+#endif
+	now = timer_wheel_now() * TIMER_WHEEL_TICK_ms;
+
+	if(source->quarantined) {
+		if((int32_t)(now - source->stamp) < 0) return(FALSE);
+		source->quarantined = FALSE;
+		source->tokens      = CONTROLLER_INPUT_BURST;
+		source->drops       = 0;
+		source->stamp       = now;
+		input_source_status(node, app_input_released);
+	}
+
+	refill = (now - source->stamp) / TOKEN_ms;
+	if(refill >= (uint32_t)(CONTROLLER_INPUT_BURST - source->tokens)) {
+		source->tokens = CONTROLLER_INPUT_BURST;
+		source->drops  = 0;
+		source->stamp  = now;
+	} else if(refill) {
+		source->tokens += refill;
+		source->stamp  += refill * TOKEN_ms;
+	}
+
+	if(source->tokens) {
+		source->tokens--;
+		return(TRUE);
+	}
+
+	if(++source->drops >= CONTROLLER_QUARANTINE_DROPS) {
+		source->quarantined = TRUE;
+		source->stamp       = now + CONTROLLER_QUARANTINE_ms;
+		input_source_status(node, app_input_quarantined);
+	}
+	return(FALSE);
+}
+#else
+#define input_allowed(node)    TRUE
+#endif // CONTROLLER_RATE_LIMIT
+
+#ifdef NODE_JOBS
+/*
+ * Inputs are triggered from a job rather than the frame handler, so a
+ * frame of inputs starting many scenes doesn't hold up the next frame.
+ * If the ring is full it's emptied, and the input triggered, there and
+ * then, so inputs are always triggered in the order they arrive.
+ */
+#define INPUT_RING_SIZE        16
+
+static uint8_t            input_ring[INPUT_RING_SIZE];
+static uint8_t            input_head = 0;
+static uint8_t            input_tail = 0;
+static struct node_job    input_job;
+
+static boolean input_trigger_next(void)
+{
+	union bool_431  es_bool;
+
+	if(input_tail == input_head) return(FALSE);
+
+	es_bool.byte = input_ring[input_tail];
+	input_tail   = (input_tail + 1) % INPUT_RING_SIZE;
+	scene_trigger(es_bool);
+	return(TRUE);
+}
+
+static uint8_t input_trigger_job(struct node_job *job)
+{
+	while(input_trigger_next()) {
+		if(node_job_yield()) return(NODE_JOB_YIELD);
+	}
+	return(NODE_JOB_DONE);
+}
+#endif // NODE_JOBS
+
 void process_bool431_input(can_frame *rx_frame)
 {
 	uint8_t                loop;
 	union bool_431         es_bool_in;
+#ifdef NODE_JOBS
+	result_t               rc;
+	uint8_t                next;
+	union sigval           data;
+#endif
 
 	for (loop = 0; loop < rx_frame->can_dlc; loop++) {
 		es_bool_in.byte = rx_frame->data[loop];
+		if(!input_allowed(es_bool_in.bitfield.node)) continue;
+#ifdef CONTROLLER_RATE_BENCH
+		bench_inputs[es_bool_in.bitfield.node]++;
+#endif
+		NODE_TRACE_POINT(TRACE_CTRL_INPUT, es_bool_in.byte, 0);
 		LOG_D("Input 0x%x:0x%x:0x%x\n\r", es_bool_in.bitfield.node, es_bool_in.bitfield.chan, es_bool_in.bitfield.es_bool);
 		
-		if (es_bool_in.bitfield.node == 0x01) {
-			node1_bool431_input(es_bool_in.byte);
+#ifdef NODE_JOBS
+		next = (input_head + 1) % INPUT_RING_SIZE;
+		if(next != input_tail) {
+			input_ring[input_head] = es_bool_in.byte;
+			input_head = next;
+			continue;
 		}
+		while(input_trigger_next());
+#endif
+		scene_trigger(es_bool_in);
 	}
+#ifdef NODE_JOBS
+	data.sival_int = 0;
+	rc = node_job_submit(&input_job, NODE_JOB_NORMAL, input_trigger_job, data);
+	RC_CHECK_PRINT_VOID("Input job\n\r");
+#endif
 }
 
-result_t app_init(uint8_t address, status_handler_t handler)
+#ifdef CONTROLLER_RATE_BENCH
+/*
+ * Two seconds of node 0x0e's "all off" switch chattering at 1kHz, while
+ * node 1's switch 1 is pressed every 100mS. Frames go over a simulated
+ * 250kbit/s bus, outputs winning arbitration over inputs, and inputs
+ * from the two nodes going in the order they were made. A node holds
+ * one input frame, so a chattering edge not yet sent is replaced by the
+ * next. Output frames beyond the bench queue are lost, as they would be
+ * with the CAN driver's transmit queue full.
+ */
+#define RATE_BENCH_RUN_ms         2000
+#define RATE_BENCH_CHATTER_us     1000
+#define RATE_BENCH_PRESS_ms        100
+#define RATE_BENCH_PRESSES         (RATE_BENCH_RUN_ms / RATE_BENCH_PRESS_ms)
+#define RATE_BENCH_BIT_TICKS(bits) ((node_ticks_t)(((uint32_t)(bits) * 4 * NODE_TICKS_PER_ms) / 1000))
+
+enum {
+	BENCH_BUS_IDLE,
+	BENCH_BUS_CHATTER,
+	BENCH_BUS_PRESS,
+	BENCH_BUS_OUTPUT,
+};
+
+/*
+ * Whether an output frame carries node 2's outputs, switched by the press
+ */
+static boolean bench_press_output(can_frame *frame)
+{
+	uint8_t         loop;
+	union bool_431  es_bool;
+
+	for(loop = 0; loop < frame->can_dlc; loop++) {
+#ifdef NODE_GROUPS
+		if((frame->can_id & ESC_TYPE_MASK) == ESC_GROUP_OUTPUT) {
+			if((frame->data[loop] & NODE_GROUP_MASK) == GROUP_NODE2) return(TRUE);
+			continue;
+		}
+#endif
+		es_bool.byte = frame->data[loop];
+		if(es_bool.bitfield.node == 0x02) return(TRUE);
+	}
+	return(FALSE);
+}
+
+static void rate_bench_run(boolean limit)
 {
+	uint16_t             loop;
+	uint8_t              on_bus = BENCH_BUS_IDLE;
+	uint8_t              chatter_value = 0;
+	boolean              chatter_waiting = FALSE;
+	uint32_t             chatter = 0;
+	uint32_t             chatter_sent = 0;
+	uint8_t              pressed = 0;
+	uint8_t              press_sent = 0;
+	uint8_t              press_done = 0;
+	uint32_t             bits = 0;
+	node_ticks_t         press_at[RATE_BENCH_PRESSES];
+	node_ticks_t         chatter_at = 0;
+	node_ticks_t         start;
+	node_ticks_t         now;
+	node_ticks_t         next_chatter;
+	node_ticks_t         next_press;
+	node_ticks_t         bus_free = 0;
+	node_ticks_t         latency;
+	node_ticks_t         worst = 0;
+	can_frame            frame;
+	can_frame            input;
+	union es_control_id  es_ctrl_id;
+	union bool_431       es_bool;
+
+	es_ctrl_id.word = 0;
+	es_ctrl_id.fields.priority = ESC_PRIORITY_2;
+	es_ctrl_id.fields.es_type  = ESC_BOOL_431_INPUT;
+	input.can_id  = es_ctrl_id.word;
+	input.can_dlc = 1;
+
+	bench_unlimited  = !limit;
+	input_sources_init();
+	for(loop = 0; loop < 16; loop++) {
+		bench_inputs[loop] = 0;
+	}
+	bench_frames     = 0;
+	bench_lost       = 0;
+	bench_queue_head = 0;
+	bench_queue_tail = 0;
+	start            = node_ticks();
+	next_chatter     = start;
+	next_press       = start;
+
+	while((node_ticks_t)((now = node_ticks()) - start) < (node_ticks_t)(RATE_BENCH_RUN_ms * NODE_TICKS_PER_ms)) {
+		asm ("CLRWDT");
+		if((int32_t)(now - next_chatter) >= 0) {
+			next_chatter += (RATE_BENCH_CHATTER_us * NODE_TICKS_PER_ms) / 1000;
+			if(!chatter_waiting) chatter_at = now;
+			chatter_waiting = TRUE;
+			chatter_value   = (chatter++ & 0x01);
+		}
+		if(((int32_t)(now - next_press) >= 0) && (pressed < RATE_BENCH_PRESSES)) {
+			next_press += RATE_BENCH_PRESS_ms * NODE_TICKS_PER_ms;
+			press_at[pressed++] = now;
+		}
+
+		if((on_bus != BENCH_BUS_IDLE) && ((int32_t)(now - bus_free) >= 0)) {
+			if(on_bus == BENCH_BUS_OUTPUT) {
+				if(bench_press_output(&frame) && (press_done < press_sent)) {
+					latency = now - press_at[press_done++];
+					if(latency > worst) worst = latency;
+				}
+			} else {
+				process_bool431_input(&frame);
+			}
+			on_bus = BENCH_BUS_IDLE;
+		}
+
+		timer_wheel_tasks();
+#ifdef NODE_JOBS
+		node_jobs_tasks();
+#endif
+		flush_outputs();
+
+		if(on_bus != BENCH_BUS_IDLE) continue;
+
+		es_bool.byte = 0x00;
+		if(bench_queue_tail != bench_queue_head) {
+			frame = bench_queue[bench_queue_tail];
+			bench_queue_tail = (bench_queue_tail + 1) % BENCH_QUEUE_SIZE;
+			on_bus = BENCH_BUS_OUTPUT;
+		} else if((press_sent < pressed) && (!chatter_waiting || ((int32_t)(chatter_at - press_at[press_sent]) > 0))) {
+			es_bool.bitfield.node    = 0x01;
+			es_bool.bitfield.chan    = 1;
+			es_bool.bitfield.es_bool = (press_sent++ & 0x01);
+			frame = input;
+			frame.data[0] = es_bool.byte;
+			on_bus = BENCH_BUS_PRESS;
+		} else if(chatter_waiting) {
+			es_bool.bitfield.node    = 0x0e;
+			es_bool.bitfield.es_bool = chatter_value;
+			frame = input;
+			frame.data[0] = es_bool.byte;
+			chatter_waiting = FALSE;
+			chatter_sent++;
+			on_bus = BENCH_BUS_CHATTER;
+		} else {
+			continue;
+		}
+		bits    += 47 + (8 * frame.can_dlc);
+		bus_free = now + RATE_BENCH_BIT_TICKS(47 + (8 * frame.can_dlc));
+	}
+	for(loop = 0; loop < NUM_SCENES; loop++) {
+		timer_wheel_cancel(&runs[loop].timer);
+		runs[loop].scene = SCENE_NONE;
+	}
+
+	LOG_I("%s: chatter %lu edges, %lu sent, %lu taken\n\r", limit ? "Limited  " : "Unlimited",
+	      (unsigned long)chatter, (unsigned long)chatter_sent, (unsigned long)bench_inputs[0x0e]);
+	LOG_I("           presses %d, %d answered, worst %luus, %lu frames out, %lu lost, bus %lu%%\n\r",
+	      pressed, press_done, (unsigned long)((worst * 1000) / NODE_TICKS_PER_ms),
+	      (unsigned long)bench_frames, (unsigned long)bench_lost,
+	      (unsigned long)((bits * 100) / (250 * RATE_BENCH_RUN_ms)));
+}
+
+static void rate_bench(void)
+{
+	bench_dry = TRUE;
+	rate_bench_run(FALSE);
+	rate_bench_run(TRUE);
+	bench_dry = FALSE;
+	input_sources_init();
+}
+#endif // CONTROLLER_RATE_BENCH
+
+result_t controller_app_init(uint8_t address, status_handler_t handler)
+{
+	result_t               rc __attribute__((unused));
 	can_l2_target_t        target;
 	union es_control_id    es_ctrl_id;
+	uint16_t               loop;
 
 	LOG_D("Master app_init(0x%x)\n\r", address);	
 	node_address = address;
 
+	for(loop = 0; loop < NUM_SCENES; loop++) {
+		TIMER_WHEEL_INIT(&runs[loop].timer);
+		runs[loop].scene = SCENE_NONE;
+	}
+#ifdef NODE_JOBS
+	NODE_JOB_INIT(&input_job);
+	input_head = 0;
+	input_tail = 0;
+#endif
+
+	es_ctrl_id.word = 0;
+	es_ctrl_id.fields.es_type = ESC_BOOL_431_OUTPUT;
+	pending.can_id  = es_ctrl_id.word;
+	pending.can_dlc = 0;
+#ifdef NODE_GROUPS
+	es_ctrl_id.fields.es_type = ESC_GROUP_OUTPUT;
+	pending_groups.can_id  = es_ctrl_id.word;
+	pending_groups.can_dlc = 0;
+#ifdef NODE_JOBS
+	NODE_JOB_INIT(&groups_job);
+#endif
+	for(loop = 0; loop < sizeof(members_pending); loop++) {
+		members_pending[loop] = 0x00;
+	}
+#ifndef CONTROLLER_HOT_STANDBY
+	groups_send();
+#endif
+#endif
+#ifdef CONTROLLER_RATE_LIMIT
+	status_handler = handler;
+	input_sources_init();
+#endif
+#ifdef SCENE_BENCH
+	scene_bench();
+#endif
+#ifdef CONTROLLER_RATE_BENCH
+	rate_bench();
+#endif
+
+#ifdef CONTROLLER_HOT_STANDBY
+	/*
+	 * Listen for a primary before driving anything
+	 */
+	TIMER_WHEEL_INIT(&role_timer);
+	for(loop = 0; loop < 16; loop++) {
+		outputs[loop] = 0x00;
+		unsent[loop]  = 0x00;
+	}
+	role          = ROLE_STANDBY;
+	outputs_sent  = FALSE;
+	heartbeat_age = 0;
+	role_timer_restart();
+
+	target.filter  = ESC_CONTROLLER_HEARTBEAT;
+	target.mask    = ESC_RTR_MASK | ESC_TYPE_MASK;
+	target.handler = heartbeat_rx;
+	rc = node_can_reg_handler(&target);
+	RC_CHECK
+
+	target.filter  = ESC_BOOL_431_OUTPUT;
+	target.mask    = ESC_RTR_MASK | ESC_TYPE_MASK;
+	target.handler = output_rx;
+	rc = node_can_reg_handler(&target);
+	RC_CHECK
+#ifdef NODE_TIME
+	target.filter  = ESC_TIMED_OUTPUT;
+	rc = node_can_reg_handler(&target);
+	RC_CHECK
+#endif
+#ifdef NODE_GROUPS
+	target.filter  = ESC_GROUP_OUTPUT;
+	rc = node_can_reg_handler(&target);
+	RC_CHECK
+#endif
+#endif
+
+#ifdef NODE_GROUPS
+	target.filter  = ESC_RTR_MASK | ESC_GROUP_CONFIG;
+	target.mask    = ESC_RTR_MASK | ESC_TYPE_MASK;
+	target.handler = groups_request;
+	rc = node_can_reg_handler(&target);
+	RC_CHECK
+#endif
+
 	/*
 	 * Register a CAN Frame handler for the Switch (43) Input frames
 	 */
@@ -193,10 +1234,15 @@ result_t app_init(uint8_t address, status_handler_t handler)
 	target.filter  = es_ctrl_id.word;
 	target.mask    = ESC_TYPE_MASK;
 	target.handler = process_bool431_input;
-	return(frame_dispatch_reg_handler(&target));
+	return(node_can_reg_handler(&target));
 }
 
-result_t app_main(void)
+/*
+ * Runs after the timer wheel on each pass of the main loop, so sends what
+ * every scene has due at this instant
+ */
+result_t controller_app_main(void)
 {
+	flush_outputs();
 	return(0);
 }
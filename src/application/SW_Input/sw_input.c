@@ -31,9 +31,19 @@ static const char *TAG = "SWI";
 #include "libesoup/comms/can/es_control/es_control.h"
 #include "libesoup/status/status.h"
 
+#include "node_can.h"
+#include "node_trace.h"
+
 #define BOUNCE_LIMIT 4
 #define NUM_INPUTS   4
 
+/*
+ * Overridden by build configurations sharing Port D with other applications
+ */
+#ifndef SW_INPUT_FIRST_PIN
+#define SW_INPUT_FIRST_PIN   RD0
+#endif
+
 static uint8_t   node_address;
 
 struct sw_input {
@@ -64,20 +74,20 @@ void switch_input_rtr(can_frame *rx_frame)
 	
 	for(loop = 0; loop < rx_frame->can_dlc; loop++) {
 		es_bool.byte = rx_frame->data[loop];
-		if(es_bool.bitfield.node == node_address) {
+		if((es_bool.bitfield.node == node_address) && (es_bool.bitfield.chan < NUM_INPUTS)) {
 			es_bool.bitfield.es_bool = input_switch[es_bool.bitfield.chan].reported_state;
 			tx_frame.data[tx_frame.can_dlc++] = es_bool.byte;
 		}
 	}
 
 	if(tx_frame.can_dlc > 0) {
-		rc = can_l2_tx_frame(&tx_frame);
+		rc = node_can_tx_frame(&tx_frame);
 		RC_CHECK_PRINT_VOID("Status resp\n\r");
 	}
 }
 #endif
 
-result_t app_init(uint8_t address, status_handler_t handler)
+result_t sw_input_app_init(uint8_t address, status_handler_t handler)
 {
 	result_t                  rc;
 	uint8_t                   loop;
@@ -99,7 +109,7 @@ result_t app_init(uint8_t address, status_handler_t handler)
 	target.filter  = ESC_RTR_MASK | ESC_BOOL_431_INPUT;
 	target.mask    = ESC_RTR_MASK | ESC_TYPE_MASK;
 	target.handler = switch_input_rtr;
-	rc = frame_dispatch_reg_handler(&target);
+	rc = node_can_reg_handler(&target);
 	RC_CHECK
 #endif
 	/*
@@ -118,10 +128,10 @@ result_t app_init(uint8_t address, status_handler_t handler)
 	 * Set the GPIO of the input pins
 	 */
 	for(loop = 0; loop < NUM_INPUTS; loop++) {
-		rc = gpio_set(RD0 + loop, GPIO_MODE_DIGITAL_INPUT, 0);
+		rc = gpio_set(SW_INPUT_FIRST_PIN + loop, GPIO_MODE_DIGITAL_INPUT, 0);
 		RC_CHECK
 		input_switch[loop].debounce_count = 0;
-		rc = gpio_get(RD0 + loop);
+		rc = gpio_get(SW_INPUT_FIRST_PIN + loop);
 		RC_CHECK
 		input_switch[loop].reported_state = rc;
 		es_bool.bitfield.chan   = loop;
@@ -135,13 +145,13 @@ result_t app_init(uint8_t address, status_handler_t handler)
 	 * Send the initial state out on the CAN Bus
 	 */
 #ifdef SYS_CAN_BUS
-	return(can_l2_tx_frame(&frame));
+	return(node_can_tx_frame(&frame));
 #else
 	return(0);
 #endif
 }
 
-result_t app_main(void)
+result_t sw_input_app_main(void)
 {
 	result_t                  rc;
 	uint8_t                   loop;
@@ -165,7 +175,7 @@ result_t app_main(void)
 	es_bool.bitfield.node  = node_address;
 
 	for(loop = 0; loop < NUM_INPUTS; loop++) {
-		rc = gpio_get(RD0 + loop);
+		rc = gpio_get(SW_INPUT_FIRST_PIN + loop);
 		RC_CHECK
 		current_state = rc;
 		if(input_switch[loop].reported_state != current_state) {
@@ -178,6 +188,7 @@ result_t app_main(void)
 				input_switch[loop].debounce_count = 0;
 				es_bool.bitfield.chan             = loop;
 				es_bool.bitfield.es_bool             = ~current_state;
+				NODE_TRACE_POINT(TRACE_SWI_EDGE, es_bool.byte, 0);
 #ifdef SYS_CAN_BUS
 				frame.data[frame.can_dlc++]       = es_bool.byte;
 #endif
@@ -190,7 +201,7 @@ result_t app_main(void)
 	}
 #ifdef SYS_CAN_BUS
 	if(frame.can_dlc > 0) {
-		return(can_l2_tx_frame(&frame));		
+		return(node_can_tx_frame(&frame));		
 	}
 #endif
 	return(0);
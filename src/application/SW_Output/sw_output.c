@@ -30,16 +30,247 @@ static const char *TAG = "SWO";
 #include "libesoup/comms/can/can.h"
 #include "libesoup/comms/can/es_control/es_control.h"
 #include "libesoup/status/status.h"
+#if (defined(NODE_GROUPS) && defined(SYS_EEPROM)) || defined(SW_OUTPUT_JOURNAL)
+#include "libesoup/hardware/eeprom.h"
+#endif
 #ifndef SYS_CAN_BUS
 #include "libesoup/timers/sw_timers.h"
 #endif
 
+#include "node_can.h"
+#include "node_groups.h"
+#include "node_jobs.h"
+#include "node_time.h"
+#include "node_trace.h"
+#include "timer_wheel.h"
+
+/*
+ * Overridden by build configurations sharing Port D with other applications
+ */
+#ifndef SW_OUTPUT_FIRST_PIN
+#define SW_OUTPUT_FIRST_PIN     RD0
+#endif
+#ifndef SW_OUTPUT_NUM_OUTPUTS
+#define SW_OUTPUT_NUM_OUTPUTS   8
+#endif
+
 static uint8_t   io_address;
+static uint8_t   outputs = 0x00;        // Bit per channel
+
+#ifdef NODE_TIME
+/*
+ * Outputs from ESC_TIMED_OUTPUT frames waiting for their bus time
+ */
+struct timed_output {
+	uint32_t  at;
+	uint8_t   es_bool;
+};
+
+static struct timed_output  timed[NODE_TIME_OUTPUT_SLOTS];
+static uint8_t              num_timed = 0;
+#endif
+
+#ifdef NODE_GROUPS
+/*
+ * The channels in each group. EEPROM holds them inverted, so an erased
+ * EEPROM is in no groups, and changes are written a group per slice by a
+ * job as EEPROM writes are slow.
+ */
+static uint8_t              groups[NODE_GROUPS_NUM];
+#ifdef SYS_EEPROM
+static uint8_t              groups_dirty[(NODE_GROUPS_NUM + 7) / 8];
+#ifdef NODE_JOBS
+static struct node_job      groups_job;
+#endif
+#endif
+#endif
+
+#ifdef SW_OUTPUT_JOURNAL
+#ifndef TIMER_WHEEL
+#error "Output journal writes are delayed on the timer wheel"
+#endif
+#if defined(NODE_GROUPS) && ((EEPROM_NODE_GROUPS_ADDR + NODE_GROUPS_NUM) > EEPROM_SW_OUTPUT_JOURNAL_ADDR)
+#error "Output groups overlap the output journal in EEPROM"
+#endif
+/*
+ * Output state journal
+ *
+ * Output state is kept in EEPROM so a node comes back from a power cut
+ * with its outputs as they were, rather than all off until the Controller
+ * sets them again. Each entry is a sequence number and the state byte,
+ * and each write goes to the next slot, spreading the wear. The newest
+ * entry is the one the sequence breaks after. The state is written before
+ * its sequence number, so a write cut short leaves the entry before it
+ * the newest.
+ */
+#define JOURNAL_EMPTY          0xff
+#define JOURNAL_SEQ_NEXT(seq)  ((uint8_t)(((seq) + 1) % JOURNAL_EMPTY))
+#define JOURNAL_ENTRY(slot)    (EEPROM_SW_OUTPUT_JOURNAL_ADDR + ((slot) * 2))
+
+static uint8_t             journal_slot;      // Newest entry
+static uint8_t             journal_seq;
+static uint8_t             journal_state;     // As last written
+static uint8_t             journal_next;      // Being written
+static struct wheel_timer  journal_timer;
+#ifdef NODE_JOBS
+static struct node_job     journal_job;
+#endif
+#endif // SW_OUTPUT_JOURNAL
+
+#ifdef SW_OUTPUT_JOURNAL
+static void journal_expiry(struct wheel_timer *timer, union sigval data);
+
+/*
+ * A change is written the delay after the first change since the last
+ * write, so a burst of changes costs a single write
+ */
+static void journal_note(void)
+{
+	result_t      rc;
+	union sigval  data;
+
+	if((outputs == journal_state) || TIMER_WHEEL_ACTIVE(&journal_timer)) return;
+
+	data.sival_int = 0;
+	rc = timer_wheel_start(&journal_timer, SW_OUTPUT_JOURNAL_DELAY_ms, FALSE, journal_expiry, data);
+	RC_CHECK_PRINT_VOID("Journal timer\n\r");
+}
+
+static result_t journal_state_write(void)
+{
+	journal_next = outputs;
+	return(eeprom_write(JOURNAL_ENTRY((journal_slot + 1) % SW_OUTPUT_JOURNAL_SLOTS) + 1, journal_next));
+}
+
+static result_t journal_commit(void)
+{
+	result_t  rc;
+
+	rc = eeprom_write(JOURNAL_ENTRY((journal_slot + 1) % SW_OUTPUT_JOURNAL_SLOTS), JOURNAL_SEQ_NEXT(journal_seq));
+	RC_CHECK
+
+	journal_slot  = (journal_slot + 1) % SW_OUTPUT_JOURNAL_SLOTS;
+	journal_seq   = JOURNAL_SEQ_NEXT(journal_seq);
+	journal_state = journal_next;
+	LOG_D("Journal %d 0x%x\n\r", journal_slot, journal_state);
+	return(0);
+}
+
+#ifdef NODE_JOBS
+/*
+ * A write per slice, the state then the sequence number
+ */
+static uint8_t journal_write_job(struct node_job *job)
+{
+	result_t  rc;
+
+	if(job->step == 0) {
+		if(outputs == journal_state) return(NODE_JOB_DONE);
+		rc = journal_state_write();
+		if(rc < 0) {
+			LOG_E("EEPROM Write\n\r");
+			return(NODE_JOB_DONE);
+		}
+		return(NODE_JOB_YIELD);
+	}
+
+	rc = journal_commit();
+	RC_CHECK_PRINT_CONT("EEPROM Write\n\r");
+	journal_note();
+	return(NODE_JOB_DONE);
+}
+#endif // NODE_JOBS
+
+static void journal_expiry(struct wheel_timer *timer, union sigval data)
+{
+	result_t  rc;
+
+#ifdef NODE_JOBS
+	rc = node_job_submit(&journal_job, NODE_JOB_LOW, journal_write_job, data);
+	RC_CHECK_PRINT_VOID("Journal job\n\r");
+#else
+	if(outputs == journal_state) return;
+	rc = journal_state_write();
+	RC_CHECK_PRINT_VOID("EEPROM Write\n\r");
+	rc = journal_commit();
+	RC_CHECK_PRINT_VOID("EEPROM Write\n\r");
+#endif
+}
+
+/*
+ * Sets the outputs from the newest journal entry, all off if there isn't
+ * one. Called from main() before the CAN Bus is initialised.
+ */
+result_t sw_output_restore(void)
+{
+	result_t  rc;
+	uint8_t   slot;
+	uint8_t   seqs[SW_OUTPUT_JOURNAL_SLOTS];
+
+	TIMER_WHEEL_INIT(&journal_timer);
+#ifdef NODE_JOBS
+	NODE_JOB_INIT(&journal_job);
+#endif
+	journal_slot  = SW_OUTPUT_JOURNAL_SLOTS - 1;
+	journal_seq   = JOURNAL_EMPTY - 1;
+	journal_state = 0x00;
+	outputs       = 0x00;
+
+	for(slot = 0; slot < SW_OUTPUT_JOURNAL_SLOTS; slot++) {
+		rc = eeprom_read(JOURNAL_ENTRY(slot));
+		RC_CHECK
+		seqs[slot] = (uint8_t)rc;
+	}
+
+	for(slot = 0; slot < SW_OUTPUT_JOURNAL_SLOTS; slot++) {
+		if(seqs[slot] == JOURNAL_EMPTY) continue;
+		if(seqs[(slot + 1) % SW_OUTPUT_JOURNAL_SLOTS] != JOURNAL_SEQ_NEXT(seqs[slot])) break;
+	}
+	if(slot < SW_OUTPUT_JOURNAL_SLOTS) {
+		rc = eeprom_read(JOURNAL_ENTRY(slot) + 1);
+		RC_CHECK
+
+		journal_slot  = slot;
+		journal_seq   = seqs[slot];
+		journal_state = (uint8_t)rc & (uint8_t)((1 << SW_OUTPUT_NUM_OUTPUTS) - 1);
+		outputs       = journal_state;
+	}
+	LOG_D("Restored 0x%x\n\r", outputs);
+
+	for(slot = 0; slot < SW_OUTPUT_NUM_OUTPUTS; slot++) {
+		rc = gpio_set(SW_OUTPUT_FIRST_PIN + slot, GPIO_MODE_DIGITAL_OUTPUT, (outputs >> slot) & 0x01);
+		RC_CHECK
+	}
+	return(0);
+}
+#else
+#define journal_note()
+#endif // SW_OUTPUT_JOURNAL
 
 #ifdef SYS_CAN_BUS
+static boolean for_me(union bool_431 es_bool)
+{
+	return((es_bool.bitfield.node == io_address) && (es_bool.bitfield.chan < SW_OUTPUT_NUM_OUTPUTS));
+}
+
+static void apply_output(union bool_431 es_bool)
+{
+	result_t  rc;
+
+	rc = gpio_set(SW_OUTPUT_FIRST_PIN + es_bool.bitfield.chan, GPIO_MODE_DIGITAL_OUTPUT, es_bool.bitfield.es_bool);
+	RC_CHECK_PRINT_VOID("gpio_set")
+	NODE_TRACE_POINT(TRACE_SWO_GPIO, es_bool.byte, 0);
+
+	if(es_bool.bitfield.es_bool) {
+		outputs |= (1 << es_bool.bitfield.chan);
+	} else {
+		outputs &= ~(1 << es_bool.bitfield.chan);
+	}
+	journal_note();
+}
+
 void switch_output_status(can_frame *frame)
 {
-	result_t          rc;
 	uint8_t           loop;
 	union bool_431    es_bool;
 	
@@ -48,13 +279,182 @@ void switch_output_status(can_frame *frame)
 		es_bool.byte = frame->data[loop];
 		LOG_D("\t[%d] %d-%d\n\r", loop, es_bool.bitfield.chan, es_bool.bitfield.es_bool);
 		
-		if(es_bool.bitfield.node == io_address) {
-			rc = gpio_set(RD0 + es_bool.bitfield.chan, GPIO_MODE_DIGITAL_OUTPUT, es_bool.bitfield.es_bool);
-			RC_CHECK_PRINT_VOID("gpio_set")
+		if(for_me(es_bool)) apply_output(es_bool);
+	}
+}
+#endif
+
+#if defined(SYS_CAN_BUS) && defined(NODE_TIME)
+/*
+ * Without bus time, or with the time already past, outputs are set as
+ * they arrive, as they would be from an ESC_BOOL_431_OUTPUT frame
+ */
+void switch_output_timed(can_frame *frame)
+{
+	uint8_t           loop;
+	uint32_t          at;
+	boolean           now;
+	union bool_431    es_bool;
+
+	if(frame->can_dlc <= NODE_TIME_OUTPUT_OFFSET) return;
+
+	at = (uint32_t)frame->data[0]
+	   | ((uint32_t)frame->data[1] << 8)
+	   | ((uint32_t)frame->data[2] << 16)
+	   | ((uint32_t)frame->data[3] << 24);
+	now = !node_time_synced() || NODE_TIME_DUE(at, node_time_now());
+
+	for(loop = NODE_TIME_OUTPUT_OFFSET; loop < frame->can_dlc; loop++) {
+		es_bool.byte = frame->data[loop];
+		if(!for_me(es_bool)) continue;
+
+		if(!now && (num_timed < NODE_TIME_OUTPUT_SLOTS)) {
+			timed[num_timed].at      = at;
+			timed[num_timed].es_bool = es_bool.byte;
+			num_timed++;
+		} else {
+			if(!now) LOG_W("Timed outputs full\n\r");
+			apply_output(es_bool);
+		}
+	}
+}
+#endif
+
+#ifdef NODE_GROUPS
+#ifdef SYS_EEPROM
+static result_t group_write(uint8_t group)
+{
+	groups_dirty[group >> 3] &= ~(1 << (group & 0x07));
+	return(eeprom_write(EEPROM_NODE_GROUPS_ADDR + group, (uint8_t)~groups[group]));
+}
+
+#ifdef NODE_JOBS
+static uint8_t groups_write_job(struct node_job *job)
+{
+	result_t  rc;
+	uint8_t   group;
+
+	for(group = 0; group < NODE_GROUPS_NUM; group++) {
+		if(groups_dirty[group >> 3] & (1 << (group & 0x07))) {
+			rc = group_write(group);
+			RC_CHECK_PRINT_CONT("EEPROM Write\n\r");
+			return(NODE_JOB_YIELD);
 		}
 	}
+	return(NODE_JOB_DONE);
 }
+#endif // NODE_JOBS
+#endif // SYS_EEPROM
+
+static void group_save(uint8_t group)
+{
+#ifdef SYS_EEPROM
+	result_t      rc;
+#ifdef NODE_JOBS
+	union sigval  data;
+
+	groups_dirty[group >> 3] |= (1 << (group & 0x07));
+	data.sival_int = 0;
+	rc = node_job_submit(&groups_job, NODE_JOB_LOW, groups_write_job, data);
+	RC_CHECK_PRINT_VOID("Groups job\n\r");
+#else
+	rc = group_write(group);
+	RC_CHECK_PRINT_VOID("EEPROM Write\n\r");
 #endif
+#endif // SYS_EEPROM
+}
+
+static void group_output(can_frame *frame)
+{
+	uint8_t           loop;
+	uint8_t           chan;
+	uint8_t           group;
+	union bool_431    es_bool;
+
+	for(loop = 0; loop < frame->can_dlc; loop++) {
+		group = frame->data[loop] & NODE_GROUP_MASK;
+		if((group >= NODE_GROUPS_NUM) || (groups[group] == 0x00)) continue;
+
+		es_bool.byte             = 0x00;
+		es_bool.bitfield.node    = io_address;
+		es_bool.bitfield.es_bool = (frame->data[loop] & NODE_GROUP_VALUE) ? 1 : 0;
+		for(chan = 0; chan < SW_OUTPUT_NUM_OUTPUTS; chan++) {
+			if(groups[group] & (1 << chan)) {
+				es_bool.bitfield.chan = chan;
+				apply_output(es_bool);
+			}
+		}
+	}
+}
+
+static void group_config(can_frame *rx_frame)
+{
+	result_t                  rc;
+	uint8_t                   group;
+	uint8_t                   mask;
+	union es_control_id       es_ctrl_id;
+	can_frame                 tx_frame;
+
+	if((rx_frame->can_dlc < 2) || (rx_frame->data[0] != io_address)) return;
+	group = rx_frame->data[1];
+	if(group >= NODE_GROUPS_NUM) return;
+
+	if(rx_frame->can_id & ESC_RTR_MASK) {
+		es_ctrl_id.word = 0x0000;
+		es_ctrl_id.fields.priority = ESC_PRIORITY_3;
+		es_ctrl_id.fields.es_type  = ESC_GROUP_CONFIG;
+		tx_frame.can_id  = es_ctrl_id.word;
+		tx_frame.can_dlc = 3;
+		tx_frame.data[0] = io_address;
+		tx_frame.data[1] = group;
+		tx_frame.data[2] = groups[group];
+		rc = node_can_tx_frame(&tx_frame);
+		RC_CHECK_PRINT_VOID("can_tx")
+		return;
+	}
+
+	if(rx_frame->can_dlc < 3) return;
+	mask = rx_frame->data[2] & (uint8_t)((1 << SW_OUTPUT_NUM_OUTPUTS) - 1);
+	if(mask == groups[group]) return;
+
+	LOG_D("Group %d 0x%x\n\r", group, mask);
+	groups[group] = mask;
+	group_save(group);
+}
+
+#ifdef SYS_CAN_BUS
+/*
+ * Ask the Controller for this node's groups, in case they've changed
+ * while the node was down or weren't sent before it was up
+ */
+static result_t groups_ask(void)
+{
+	union es_control_id       es_ctrl_id;
+	can_frame                 tx_frame;
+
+	es_ctrl_id.word = 0x0000;
+	es_ctrl_id.fields.priority = ESC_PRIORITY_3;
+	es_ctrl_id.fields.es_type  = ESC_GROUP_CONFIG;
+	es_ctrl_id.fields.rtr      = 1;
+	tx_frame.can_id  = es_ctrl_id.word;
+	tx_frame.can_dlc = 1;
+	tx_frame.data[0] = io_address;
+	return(node_can_tx_frame(&tx_frame));
+}
+#endif
+
+/*
+ * One handler table entry for group outputs and group configuration
+ */
+void switch_output_group(can_frame *frame)
+{
+	if((frame->can_id & ESC_TYPE_MASK) == ESC_GROUP_OUTPUT) {
+		if(!(frame->can_id & ESC_RTR_MASK)) group_output(frame);
+	} else {
+		group_config(frame);
+	}
+}
+#endif // NODE_GROUPS
 
 #ifdef SYS_CAN_BUS
 void switch_output_rtr(can_frame *rx_frame)
@@ -74,20 +474,63 @@ void switch_output_rtr(can_frame *rx_frame)
 	for(loop = 0; loop < rx_frame->can_dlc; loop++) {
 		es_bool.byte = rx_frame->data[loop];
 		
-		if(es_bool.bitfield.node == io_address) {
-			rc = gpio_get(RD0 + es_bool.bitfield.chan);
+		if((es_bool.bitfield.node == io_address) && (es_bool.bitfield.chan < SW_OUTPUT_NUM_OUTPUTS)) {
+			rc = gpio_get(SW_OUTPUT_FIRST_PIN + es_bool.bitfield.chan);
 			RC_CHECK_PRINT_VOID("gpio_get")
 			es_bool.bitfield.es_bool  = rc;
 			tx_frame.data[tx_frame.can_dlc++] = es_bool.byte;
 		}
 	}
 	if(tx_frame.can_dlc > 0) {
-		rc = can_l2_tx_frame(&tx_frame);
+		rc = node_can_tx_frame(&tx_frame);
 		RC_CHECK_PRINT_VOID("can_tx")
 	}
 }
 #endif
 
+#ifdef SYS_CAN_BUS
+/*
+ * One handler table entry for both the status update and status request
+ */
+void switch_output_frame(can_frame *frame)
+{
+	if(frame->can_id & ESC_RTR_MASK) {
+		switch_output_rtr(frame);
+	} else {
+		switch_output_status(frame);
+	}
+}
+#endif
+
+#if defined(SYS_CAN_BUS) && defined(SW_OUTPUT_JOURNAL)
+/*
+ * Every channel's state in one frame, once the CAN Bus connects, in place
+ * of the Controller having to set or ask for each output in turn
+ */
+static result_t state_announce(void)
+{
+	uint8_t                   chan;
+	union bool_431            es_bool;
+	union es_control_id       es_ctrl_id;
+	can_frame                 tx_frame;
+
+	es_ctrl_id.word = 0x0000;
+	es_ctrl_id.fields.priority = ESC_PRIORITY_3;
+	es_ctrl_id.fields.es_type  = ESC_BOOL_431_OUTPUT;
+	tx_frame.can_id  = es_ctrl_id.word;
+	tx_frame.can_dlc = 0;
+
+	for(chan = 0; chan < SW_OUTPUT_NUM_OUTPUTS; chan++) {
+		es_bool.byte             = 0x00;
+		es_bool.bitfield.node    = io_address;
+		es_bool.bitfield.chan    = chan;
+		es_bool.bitfield.es_bool = (outputs >> chan) & 0x01;
+		tx_frame.data[tx_frame.can_dlc++] = es_bool.byte;
+	}
+	return(node_can_tx_frame(&tx_frame));
+}
+#endif
+
 #ifndef SYS_CAN_BUS
 void toggle(timer_id timer, union sigval data)
 {
@@ -100,7 +543,7 @@ void toggle(timer_id timer, union sigval data)
 }
 #endif
 
-result_t app_init(uint8_t address, status_handler_t handler)
+result_t sw_output_app_init(uint8_t address, status_handler_t handler)
 {
 	result_t               rc;
 	uint8_t                loop;
@@ -110,31 +553,95 @@ result_t app_init(uint8_t address, status_handler_t handler)
 	io_address = address;
 
 	/*
-	 * Set the GPIO of the output pins
+	 * Set the GPIO of the output pins, all off unless they've been
+	 * restored from the journal
 	 */
-	for(loop = RD0; loop < RD8; loop++) {
-		rc = gpio_set(loop, GPIO_MODE_DIGITAL_OUTPUT, 0);
+	for(loop = 0; loop < SW_OUTPUT_NUM_OUTPUTS; loop++) {
+		rc = gpio_set(SW_OUTPUT_FIRST_PIN + loop, GPIO_MODE_DIGITAL_OUTPUT, (outputs >> loop) & 0x01);
 	}
 
 	/*
-	 * Register a CAN Frame handler for the status_request frame
+	 * Register a CAN Frame handler for the status update and status
+	 * request frames
 	 */
-	target.filter  = ESC_RTR_MASK | ESC_BOOL_431_OUTPUT;
-	target.mask    = ESC_RTR_MASK | ESC_TYPE_MASK;
-	target.handler = switch_output_rtr;
-	rc = frame_dispatch_reg_handler(&target);
+	target.filter  = ESC_BOOL_431_OUTPUT;
+	target.mask    = ESC_TYPE_MASK;
+	target.handler = switch_output_frame;
+	rc = node_can_reg_handler(&target);
 	RC_CHECK
 
-	/*
-	 * Register a CAN Frame handler for the status update frame
-	 */
-	target.filter  = ESC_BOOL_431_OUTPUT;
+#ifdef NODE_TIME
+	num_timed      = 0;
+	target.filter  = ESC_TIMED_OUTPUT;
 	target.mask    = ESC_RTR_MASK | ESC_TYPE_MASK;
-	target.handler = switch_output_status;
-	return(frame_dispatch_reg_handler(&target));
+	target.handler = switch_output_timed;
+	rc = node_can_reg_handler(&target);
+	RC_CHECK
+#endif
+
+#ifdef NODE_GROUPS
+	for(loop = 0; loop < NODE_GROUPS_NUM; loop++) {
+#ifdef SYS_EEPROM
+		rc = eeprom_read(EEPROM_NODE_GROUPS_ADDR + loop);
+		groups[loop] = (rc < 0) ? 0x00 : (uint8_t)~rc;
+#else
+		groups[loop] = 0x00;
+#endif
+	}
+#ifdef SYS_EEPROM
+	for(loop = 0; loop < sizeof(groups_dirty); loop++) {
+		groups_dirty[loop] = 0x00;
+	}
+#ifdef NODE_JOBS
+	NODE_JOB_INIT(&groups_job);
+#endif
+#endif
+
+	target.filter  = ESC_GROUP_CONFIG;
+	target.mask    = NODE_GROUP_TYPE_MASK;
+	target.handler = switch_output_group;
+	rc = node_can_reg_handler(&target);
+	RC_CHECK
+#ifdef SYS_CAN_BUS
+	rc = groups_ask();
+	RC_CHECK_PRINT_CONT("Groups ask\n\r");
+#endif
+#endif
+
+#if defined(SYS_CAN_BUS) && defined(SW_OUTPUT_JOURNAL)
+	rc = state_announce();
+	RC_CHECK_PRINT_CONT("State announce\n\r");
+#endif
+	return(0);
 }
 
-result_t app_main(void)
+/*
+ * Only polled with NODE_TIME, to set timed outputs as they fall due
+ */
+result_t sw_output_app_main(void)
 {
+#ifdef NODE_TIME
+	uint8_t         loop;
+	uint8_t         kept = 0;
+	uint32_t        now;
+	union bool_431  es_bool;
+
+	if(num_timed == 0) return(0);
+
+	/*
+	 * Set in arrival order, so of two changes to an output falling due
+	 * together the later one sticks
+	 */
+	now = node_time_now();
+	for(loop = 0; loop < num_timed; loop++) {
+		if(NODE_TIME_DUE(timed[loop].at, now)) {
+			es_bool.byte = timed[loop].es_bool;
+			apply_output(es_bool);
+		} else {
+			timed[kept++] = timed[loop];
+		}
+	}
+	num_timed = kept;
+#endif
 	return(0);
 }
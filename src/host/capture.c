@@ -0,0 +1,294 @@
+/**
+ * @file host/capture.c
+ *
+ * @author John Whitmore
+ *
+ * @brief CAN Bus capture and replay for host builds
+ *
+ * Copyright 2018 electronicSoup
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the version 3 of the GNU General Public License
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#include "libesoup_config.h"
+
+#if defined(NODE_CAPTURE) || defined(NODE_REPLAY)
+
+#if !defined(__RPI)
+#error "Bus capture and replay are for host (__RPI) builds"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef SYS_SERIAL_LOGGING
+#define DEBUG_FILE
+static const char *TAG = "Capture";
+#include "libesoup/logger/serial_log.h"
+#endif // SYS_SERIAL_LOGGING
+
+#include "libesoup/errno.h"
+#include "libesoup/comms/can/can.h"
+#include "libesoup/status/status.h"
+
+#include "node_ticks.h"
+#include "node_can.h"
+#include "host/capture.h"
+
+static FILE *open_capture(const char *name, node_ticks_t *start)
+{
+	FILE                   *file;
+	struct capture_header   header;
+	struct timespec         now;
+	uint64_t                start_us;
+
+	file = fopen(name, "wb");
+	if(!file) return(NULL);
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	start_us = ((uint64_t)now.tv_sec * 1000000) + (now.tv_nsec / 1000);
+	*start   = node_ticks();
+
+	header.magic       = CAPTURE_MAGIC;
+	header.version     = CAPTURE_VERSION;
+	header.record_size = sizeof(struct capture_record);
+	header.start_us_lo = (uint32_t)start_us;
+	header.start_us_hi = (uint32_t)(start_us >> 32);
+	fwrite(&header, sizeof(header), 1, file);
+	return(file);
+}
+
+static void write_record(FILE *file, node_ticks_t start, can_frame *frame, uint8_t flags)
+{
+	struct capture_record  record;
+
+	memset(&record, 0x00, sizeof(record));
+	record.timestamp_us = node_ticks() - start;
+	record.can_id       = frame->can_id;
+	record.can_dlc      = frame->can_dlc;
+	record.flags        = flags;
+	memcpy(record.data, frame->data, (frame->can_dlc > 8) ? 8 : frame->can_dlc);
+	fwrite(&record, sizeof(record), 1, file);
+}
+
+#ifdef NODE_CAPTURE
+static FILE          *capture_file;
+static node_ticks_t   capture_start;
+
+result_t capture_init(void)
+{
+	const char *name;
+
+	name = getenv("NODE_CAPTURE_FILE");
+	capture_file = open_capture((name) ? name : "node.ecap", &capture_start);
+	if(!capture_file) {
+		LOG_E("Failed to open capture file\n\r");
+		return(-ERR_GENERAL_ERROR);
+	}
+	return(0);
+}
+
+void capture_frame(can_frame *frame, uint8_t flags)
+{
+	if(capture_file) write_record(capture_file, capture_start, frame, flags);
+}
+#endif // NODE_CAPTURE
+
+#ifdef NODE_REPLAY
+struct queued {
+	can_frame     frame;
+	node_ticks_t  due;
+};
+
+struct handler_stats {
+	void        (*handler)(can_frame *);
+	uint32_t      count;
+	node_ticks_t  min;
+	node_ticks_t  max;
+	uint64_t      total;
+};
+
+static const struct capture_record  *records;
+static size_t                        num_records;
+static size_t                        next_record;
+static uint32_t                      speed;
+static node_ticks_t                  replay_start;
+static uint32_t                      last_timestamp;
+static uint64_t                      elapsed_us;
+
+/*
+ * Model of the L2 driver's receive ring
+ */
+static struct queued                 ring[SYS_CAN_RX_CIR_BUFFER_SIZE];
+static uint16_t                      ring_head;
+static uint16_t                      ring_count;
+static node_ticks_t                  current_due;
+
+static struct handler_stats          stats[NODE_CAN_HANDLER_ARRAY_SIZE];
+static uint32_t                      delivered;
+static uint32_t                      dropped;
+static uint32_t                      transmitted;
+static uint16_t                      high_water;
+
+static FILE                         *output_file;
+static node_ticks_t                  output_start;
+
+result_t capture_replay_init(status_handler_t handler)
+{
+	int                            fd;
+	struct stat                    info;
+	const char                    *name;
+	const struct capture_header   *header;
+	void                          *map;
+
+	name = getenv("NODE_REPLAY_FILE");
+	if(!name) {
+		LOG_E("NODE_REPLAY_FILE not set\n\r");
+		return(-ERR_BAD_INPUT_PARAMETER);
+	}
+	fd = open(name, O_RDONLY);
+	if((fd < 0) || (fstat(fd, &info) < 0) || (info.st_size < (off_t)sizeof(struct capture_header))) {
+		LOG_E("Failed to open %s\n\r", name);
+		return(-ERR_BAD_INPUT_PARAMETER);
+	}
+	map = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED) return(-ERR_GENERAL_ERROR);
+
+	header = (const struct capture_header *)map;
+	if((header->magic != CAPTURE_MAGIC) || (header->version != CAPTURE_VERSION)
+	    || (header->record_size != sizeof(struct capture_record))) {
+		LOG_E("%s is not a capture file\n\r", name);
+		return(-ERR_BAD_INPUT_PARAMETER);
+	}
+	records     = (const struct capture_record *)(header + 1);
+	num_records = (info.st_size - sizeof(struct capture_header)) / sizeof(struct capture_record);
+	next_record = 0;
+
+	name  = getenv("NODE_REPLAY_SPEED");
+	speed = (name) ? (uint32_t)strtoul(name, NULL, 0) : 1;
+
+	name = getenv("NODE_REPLAY_OUTPUT");
+	if(name) output_file = open_capture(name, &output_start);
+
+	last_timestamp = (num_records) ? records[0].timestamp_us : 0;
+	elapsed_us     = 0;
+	replay_start   = node_ticks();
+
+	/*
+	 * The replayed bus stands in for the L2 driver connecting
+	 */
+	handler(can_bus_l2_status, can_l2_connected, baud_250K);
+	return(0);
+}
+
+static void enqueue(const struct capture_record *record, node_ticks_t due)
+{
+	struct queued  *entry;
+
+	if(ring_count == SYS_CAN_RX_CIR_BUFFER_SIZE) {
+		dropped++;
+		return;
+	}
+	entry = &ring[(ring_head + ring_count) % SYS_CAN_RX_CIR_BUFFER_SIZE];
+	entry->frame.can_id  = record->can_id;
+	entry->frame.can_dlc = record->can_dlc;
+	memcpy(entry->frame.data, record->data, 8);
+	entry->due = due;
+	ring_count++;
+	if(ring_count > high_water) high_water = ring_count;
+}
+
+static void report(void)
+{
+	uint8_t  loop;
+
+	printf("Replay: %u frames delivered, %u dropped, %u transmitted, ring high water %u/%u\n",
+	       delivered, dropped, transmitted, high_water, SYS_CAN_RX_CIR_BUFFER_SIZE);
+	printf("  %-5s %-18s %10s %10s %10s %10s\n", "index", "handler", "frames", "min us", "avg us", "max us");
+	for(loop = 0; loop < NODE_CAN_HANDLER_ARRAY_SIZE; loop++) {
+		if(stats[loop].count == 0) continue;
+		printf("  %-5u %-18p %10u %10u %10u %10u\n", loop, (void *)stats[loop].handler,
+		       stats[loop].count, stats[loop].min,
+		       (uint32_t)(stats[loop].total / stats[loop].count), stats[loop].max);
+	}
+	if(output_file) fclose(output_file);
+}
+
+void capture_replay_tasks(void)
+{
+	node_ticks_t                  now;
+	node_ticks_t                  due;
+	const struct capture_record  *record;
+
+	now = node_ticks();
+
+	while(next_record < num_records) {
+		record = &records[next_record];
+		if(speed == 0) {
+			if(ring_count == SYS_CAN_RX_CIR_BUFFER_SIZE) break;
+			due = now;
+		} else {
+			due = replay_start + (node_ticks_t)((elapsed_us + (uint32_t)(record->timestamp_us - last_timestamp)) / speed);
+			if((node_ticks_t)(now - due) > ((node_ticks_t)~0 >> 1)) break;
+		}
+		elapsed_us    += (uint32_t)(record->timestamp_us - last_timestamp);
+		last_timestamp = record->timestamp_us;
+		next_record++;
+		if(record->flags & CAPTURE_FLAG_TX) continue;
+		enqueue(record, due);
+	}
+
+	while(ring_count) {
+		current_due = ring[ring_head].due;
+		node_can_rx_frame(&ring[ring_head].frame);
+		ring_head = (ring_head + 1) % SYS_CAN_RX_CIR_BUFFER_SIZE;
+		ring_count--;
+		delivered++;
+	}
+
+	if(next_record == num_records) {
+		report();
+		exit(0);
+	}
+}
+
+void capture_replay_handled(uint8_t index, void (*handler)(can_frame *))
+{
+	node_ticks_t  latency;
+
+	if(index >= NODE_CAN_HANDLER_ARRAY_SIZE) return;
+
+	latency = node_ticks() - current_due;
+	if((stats[index].count == 0) || (latency < stats[index].min)) stats[index].min = latency;
+	if(latency > stats[index].max) stats[index].max = latency;
+	stats[index].handler = handler;
+	stats[index].total  += latency;
+	stats[index].count++;
+}
+
+result_t capture_replay_tx(can_frame *frame)
+{
+	transmitted++;
+	if(output_file) write_record(output_file, output_start, frame, CAPTURE_FLAG_TX);
+	return(0);
+}
+#endif // NODE_REPLAY
+
+#endif // NODE_CAPTURE || NODE_REPLAY
@@ -0,0 +1,83 @@
+/**
+ * @file host/capture.h
+ *
+ * @author John Whitmore
+ *
+ * @brief CAN Bus capture file format, capture and replay for host builds
+ *
+ * Copyright 2018 electronicSoup
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the version 3 of the GNU General Public License
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#ifndef _CAPTURE_H
+#define _CAPTURE_H
+
+/*
+ * A capture file is a header followed by fixed size records in time order,
+ * all little endian and naturally aligned so a file can be mapped and
+ * indexed directly. tools/capture.py converts to and from candump logs.
+ *
+ * timestamp_us is relative to start_us in the header and wraps every 71
+ * minutes; readers unwrap it, a live bus is never quiet for that long.
+ * can_id carries the EFF/RTR/ERR flags as in a Linux can_frame.
+ */
+#define CAPTURE_MAGIC        0x50414345     // "ECAP"
+#define CAPTURE_VERSION      1
+
+struct capture_header {
+	uint32_t  magic;
+	uint16_t  version;
+	uint16_t  record_size;
+	uint32_t  start_us_lo;
+	uint32_t  start_us_hi;
+};
+
+struct capture_record {
+	uint32_t  timestamp_us;
+	uint32_t  can_id;
+	uint8_t   can_dlc;
+	uint8_t   flags;
+	uint8_t   reserved[2];
+	uint8_t   data[8];
+};
+
+#define CAPTURE_FLAG_TX      0x01           // Transmitted by the capturing node
+
+#ifdef NODE_CAPTURE
+/*
+ * Frames passing through node_can are appended to the file named by the
+ * NODE_CAPTURE_FILE environment variable
+ */
+extern result_t capture_init(void);
+extern void     capture_frame(can_frame *frame, uint8_t flags);
+#endif
+
+#ifdef NODE_REPLAY
+/*
+ * Replays the capture named by NODE_REPLAY_FILE into node_can in place of
+ * the CAN Bus. NODE_REPLAY_SPEED is the speed up over the original timing,
+ * 0 delivering frames as fast as the Node takes them. Frames are queued
+ * through a model of the L2 receive ring of SYS_CAN_RX_CIR_BUFFER_SIZE and
+ * dropped when it is full, frames transmitted are counted and, if
+ * NODE_REPLAY_OUTPUT names a file, captured to it. At the end of the
+ * capture per handler latency and drop counts are printed and the process
+ * exits.
+ */
+extern result_t capture_replay_init(status_handler_t handler);
+extern void     capture_replay_tasks(void);
+extern result_t capture_replay_tx(can_frame *frame);
+extern void     capture_replay_handled(uint8_t index, void (*handler)(can_frame *));
+#endif
+
+#endif // _CAPTURE_H
@@ -0,0 +1,818 @@
+/**
+ * @file host/gateway.c
+ *
+ * @author John Whitmore
+ *
+ * @brief Gateway between two CAN segments for host builds
+ *
+ * Copyright 2018 electronicSoup
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the version 3 of the GNU General Public License
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+/*
+ * recvmmsg() and sendmmsg() are GNU extensions, defined before any system
+ * header is pulled in
+ */
+#define _GNU_SOURCE
+#include "libesoup_config.h"
+
+#ifdef NODE_GATEWAY
+
+#if !defined(__RPI)
+#error "Gateway is for host (__RPI) builds"
+#endif
+#if (NODE_GATEWAY_QUEUE & (NODE_GATEWAY_QUEUE - 1)) != 0
+#error "NODE_GATEWAY_QUEUE must be a power of 2"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <linux/can.h>
+#include <linux/can/raw.h>
+
+#ifdef SYS_SERIAL_LOGGING
+#define DEBUG_FILE
+static const char *TAG = "Gateway";
+#include "libesoup/logger/serial_log.h"
+#endif // SYS_SERIAL_LOGGING
+
+#include "libesoup/errno.h"
+#include "libesoup/comms/can/can.h"
+#include "libesoup/comms/can/es_control/es_control.h"
+
+#include "node_ticks.h"
+#include "node_time.h"
+#include "node_groups.h"
+#include "host/gateway.h"
+
+/*
+ * Each segment's receive thread learns from the frames it reads, filters
+ * them and puts those for the far segment on its direction's queue, a
+ * single producer, single consumer ring. gateway_tasks() is the only
+ * consumer of both.
+ *
+ * Whether a frame is forwarded is read from two bitmaps per direction,
+ * indexed by the 11 bit CAN ID: frames with IDs in the first always are,
+ * those in the second are if a node they're addressed to is on the far
+ * segment, or hasn't been located yet. The bitmaps are compiled from the
+ * route table below at init, and an ES type's bits compiled again when a
+ * segment subscribes to it, so the receive threads never wait on a lock.
+ *
+ * What the gateway learns:
+ *
+ *   - A node is on the segment its reports, inputs, stats or trace
+ *     replies and heartbeats, are read from.
+ *   - A Switch Output node is on the segment its state, announced on
+ *     connect or sent in reply to a request, is read from.
+ *   - A segment subscribes to an ES type once a request, an RTR frame, for
+ *     it is read there, and to inputs once a Controller is, from its
+ *     heartbeats, timed or group outputs.
+ *
+ * Reports are flooded until some segment subscribes to their type, and
+ * commands until the node they're for is located, so nothing is lost
+ * while the gateway learns. Subscriptions are never dropped. Only 11 bit
+ * frames are forwarded, ES Control uses no others.
+ */
+#define SEGMENTS             2
+#define NODES_NUM          256
+#define NODE_UNKNOWN      0xff
+#define ID_NUM           (CAN_SFF_MASK + 1)
+#define ID_WORDS         (ID_NUM / 32)
+#define TYPES_NUM        (ESC_TYPE_MASK + 1)
+#define QUEUE_MASK       (NODE_GATEWAY_QUEUE - 1)
+
+enum route {
+	route_report = 0,       // To segments subscribed to the type
+	route_node,             // To the node addressed
+	route_all,              // Everywhere
+};
+
+enum node_at {
+	at_none = 0,
+	at_bool,                // bool_431 node field of every byte
+	at_timed,               // bool_431 bytes after the bus time
+	at_data0,               // Node address in data[0]
+};
+
+#define LEARN_NODE           0x01    // Frame locates the node it's from
+#define LEARN_CONTROLLER     0x02    // Frame's segment wants inputs
+#define LEARN_STATUS         0x04    // Frame locates its node if it's a node's own state
+
+/*
+ * Nodes send their own state at ESC_PRIORITY_3, the Controller its
+ * commands at the default priority
+ */
+#define STATUS_PRIORITY      ESC_PRIORITY_3
+
+/*
+ * ES types not listed are reports with nothing to locate
+ */
+#define GATEWAY_ROUTES(X)                                                       \
+	X(ESC_BOOL_431_INPUT,       route_report, at_bool,  LEARN_NODE)         \
+	X(ESC_BOOL_431_OUTPUT,      route_node,   at_bool,  LEARN_STATUS)       \
+	X(ESC_ADC_INPUT,            route_report, at_data0, LEARN_NODE)         \
+	X(ESC_NODE_STATS,           route_report, at_data0, LEARN_NODE)         \
+	X(ESC_NODE_TRACE,           route_report, at_data0, LEARN_NODE)         \
+	X(ESC_CONTROLLER_HEARTBEAT, route_all,    at_data0, LEARN_NODE | LEARN_CONTROLLER) \
+	X(ESC_NODE_TIME,            route_all,    at_data0, LEARN_NODE)         \
+	X(ESC_TIMED_OUTPUT,         route_node,   at_timed, LEARN_CONTROLLER)   \
+	X(ESC_GROUP_OUTPUT,         route_all,    at_none,  LEARN_CONTROLLER)   \
+	X(ESC_GROUP_CONFIG,         route_node,   at_data0, 0)
+
+struct route_entry {
+	uint8_t  route;
+	uint8_t  at;
+	uint8_t  learn;
+};
+
+static const struct route_entry routes[TYPES_NUM] = {
+#define ROUTE_ENTRY(type, route, at, learn)  [type] = { route, at, learn },
+	GATEWAY_ROUTES(ROUTE_ENTRY)
+#undef ROUTE_ENTRY
+};
+
+struct gateway_entry {
+	struct can_frame  frame;
+	node_ticks_t      at;           // Read from the source segment
+};
+
+/*
+ * head is only written by the receive thread and tail by gateway_tasks(),
+ * each on its own cache line
+ */
+struct gateway_queue {
+	_Alignas(64) _Atomic uint32_t  head;
+	_Alignas(64) _Atomic uint32_t  tail;
+	struct gateway_entry           entries[NODE_GATEWAY_QUEUE];
+};
+
+/*
+ * Indexed by the segment frames are read from
+ */
+static struct gateway_queue   queues[SEGMENTS];
+static _Atomic uint32_t       forward[SEGMENTS][ID_WORDS];
+static _Atomic uint32_t       by_node[SEGMENTS][ID_WORDS];
+static _Atomic uint32_t       subscribed[SEGMENTS][TYPES_NUM / 32];
+static _Atomic uint8_t        node_segment[NODES_NUM];
+static pthread_mutex_t        compile_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint32_t               filtered[SEGMENTS];
+static _Atomic uint32_t       overflow[SEGMENTS];     // Written by the receive threads
+static uint32_t               overflow_logged[SEGMENTS];
+
+static const char            *names[SEGMENTS];
+static int                    sockets[SEGMENTS] = { -1, -1 };
+static pthread_t              threads[SEGMENTS];
+
+static struct can_frame       tx_frames[NODE_GATEWAY_BATCH];
+static struct iovec           tx_iov[NODE_GATEWAY_BATCH];
+static struct mmsghdr         tx_msgs[NODE_GATEWAY_BATCH];
+
+#ifdef NODE_GATEWAY_BENCH
+static boolean                bench_sink = FALSE;
+static uint32_t               bench_forwarded[SEGMENTS];
+static uint32_t               bench_latency_max;
+static uint64_t               bench_latency_total;
+#endif
+
+#define BIT_TEST(map, bit)    ((atomic_load_explicit(&(map)[(bit) >> 5], memory_order_relaxed) >> ((bit) & 0x1f)) & 0x01)
+
+static void bit_write(_Atomic uint32_t *map, uint16_t bit, boolean value)
+{
+	if(value) {
+		atomic_fetch_or_explicit(&map[bit >> 5], (uint32_t)1 << (bit & 0x1f), memory_order_relaxed);
+	} else {
+		atomic_fetch_and_explicit(&map[bit >> 5], ~((uint32_t)1 << (bit & 0x1f)), memory_order_relaxed);
+	}
+}
+
+/*
+ * Called with compile_lock held
+ */
+static void compile_type(uint8_t type)
+{
+	const struct route_entry  *route = &routes[type];
+	union es_control_id        es_id;
+	uint16_t                   id;
+	uint8_t                    seg;
+	uint8_t                    far;
+	boolean                    always;
+	boolean                    node;
+
+	for(id = 0; id < ID_NUM; id++) {
+		if((id & ESC_TYPE_MASK) != type) continue;
+
+		for(seg = 0; seg < SEGMENTS; seg++) {
+			far = seg ^ 0x01;
+
+			if(id & ESC_RTR_MASK) {
+				always = (route->at == at_none);
+				node   = !always;
+			} else if(route->route == route_all) {
+				always = TRUE;
+				node   = FALSE;
+			} else if(route->route == route_node) {
+				/*
+				 * A node's own frames of a command type,
+				 * status replies, go where they're asked for.
+				 * Commands go to the node addressed.
+				 */
+				es_id.word = id;
+				always = (es_id.fields.priority == STATUS_PRIORITY) && BIT_TEST(subscribed[far], type);
+				node   = TRUE;
+			} else {
+				always = BIT_TEST(subscribed[far], type) || !BIT_TEST(subscribed[seg], type);
+				node   = FALSE;
+			}
+			bit_write(forward[seg], id, always);
+			bit_write(by_node[seg], id, node);
+		}
+	}
+}
+
+static void subscribe(uint8_t seg, uint8_t type)
+{
+	if(BIT_TEST(subscribed[seg], type)) return;
+
+	pthread_mutex_lock(&compile_lock);
+	bit_write(subscribed[seg], type, TRUE);
+	compile_type(type);
+	pthread_mutex_unlock(&compile_lock);
+
+	LOG_I("%s subscribed to 0x%x\n\r", names[seg], type);
+}
+
+static void locate(uint8_t seg, uint8_t node)
+{
+	if(atomic_load_explicit(&node_segment[node], memory_order_relaxed) != seg) {
+		atomic_store_explicit(&node_segment[node], seg, memory_order_relaxed);
+	}
+}
+
+/*
+ * Nodes named by a frame, returned in nodes[], and how many
+ */
+static uint8_t frame_nodes(const struct can_frame *frame, uint8_t at, uint8_t *nodes)
+{
+	union bool_431  es_bool;
+	uint8_t         loop;
+	uint8_t         first;
+	uint8_t         count = 0;
+
+	switch(at) {
+	case at_data0:
+		if(frame->can_dlc < 1) return(0);
+		nodes[0] = frame->data[0];
+		return(1);
+	case at_bool:
+	case at_timed:
+		first = (at == at_timed) ? NODE_TIME_OUTPUT_OFFSET : 0;
+		for(loop = first; (loop < frame->can_dlc) && (loop < CAN_MAX_DLEN); loop++) {
+			es_bool.byte    = frame->data[loop];
+			nodes[count++]  = es_bool.bitfield.node;
+		}
+		return(count);
+	default:
+		return(0);
+	}
+}
+
+static void learn(uint8_t seg, const struct can_frame *frame)
+{
+	const struct route_entry  *route;
+	union es_control_id        es_id;
+	uint8_t                    type;
+	uint8_t                    nodes[CAN_MAX_DLEN];
+	uint8_t                    count;
+	uint8_t                    loop;
+
+	type  = frame->can_id & ESC_TYPE_MASK;
+	route = &routes[type];
+
+	if(frame->can_id & ESC_RTR_MASK) {
+		subscribe(seg, type);
+		return;
+	}
+	if(route->learn & LEARN_CONTROLLER) {
+		subscribe(seg, ESC_BOOL_431_INPUT);
+		subscribe(seg, ESC_ADC_INPUT);
+	}
+	if(route->learn & LEARN_NODE) {
+		count = frame_nodes(frame, route->at, nodes);
+		for(loop = 0; loop < count; loop++) locate(seg, nodes[loop]);
+	}
+	if(route->learn & LEARN_STATUS) {
+		/*
+		 * Only a node's own state names it alone, at its priority
+		 */
+		es_id.word = (uint16_t)(frame->can_id & CAN_SFF_MASK);
+		if(es_id.fields.priority != STATUS_PRIORITY) return;
+
+		count = frame_nodes(frame, route->at, nodes);
+		for(loop = 1; loop < count; loop++) {
+			if(nodes[loop] != nodes[0]) return;
+		}
+		if(count > 0) locate(seg, nodes[0]);
+	}
+}
+
+/*
+ * A frame with no node named is sent, as it can't be told apart
+ */
+static boolean node_far(uint8_t seg, const struct can_frame *frame)
+{
+	uint8_t  nodes[CAN_MAX_DLEN];
+	uint8_t  count;
+	uint8_t  loop;
+
+	count = frame_nodes(frame, routes[frame->can_id & ESC_TYPE_MASK].at, nodes);
+	if(count == 0) return(TRUE);
+
+	for(loop = 0; loop < count; loop++) {
+		if(atomic_load_explicit(&node_segment[nodes[loop]], memory_order_relaxed) != seg) return(TRUE);
+	}
+	return(FALSE);
+}
+
+static boolean wanted(uint8_t seg, const struct can_frame *frame)
+{
+	uint16_t  id;
+
+	if(frame->can_id & (CAN_EFF_FLAG | CAN_ERR_FLAG)) return(FALSE);
+
+	id = frame->can_id & CAN_SFF_MASK;
+	if(BIT_TEST(forward[seg], id)) return(TRUE);
+	if(BIT_TEST(by_node[seg], id)) return(node_far(seg, frame));
+	return(FALSE);
+}
+
+/*
+ * Receive thread side of a direction's queue
+ */
+static result_t gateway_rx(uint8_t seg, const struct can_frame *frame, node_ticks_t at)
+{
+	struct gateway_queue  *queue = &queues[seg];
+	struct gateway_entry  *entry;
+	uint32_t               head;
+
+	learn(seg, frame);
+	if(!wanted(seg, frame)) {
+		filtered[seg]++;
+		return(0);
+	}
+
+	head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+	if(head - atomic_load_explicit(&queue->tail, memory_order_acquire) == NODE_GATEWAY_QUEUE) {
+		return(-ERR_NO_RESOURCES);
+	}
+	entry        = &queue->entries[head & QUEUE_MASK];
+	entry->frame = *frame;
+	entry->at    = at;
+	atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+	return(0);
+}
+
+/*
+ * The bus time in a sync was read on the source segment a frame time
+ * before it was stamped, and has waited in the gateway since
+ */
+static void retime(struct can_frame *frame, node_ticks_t at, node_ticks_t now)
+{
+	uint32_t  time;
+
+	if(((frame->can_id & (ESC_RTR_MASK | ESC_TYPE_MASK)) != ESC_NODE_TIME) || (frame->can_dlc < 6)) return;
+
+	time = (uint32_t)frame->data[2]
+	     | ((uint32_t)frame->data[3] << 8)
+	     | ((uint32_t)frame->data[4] << 16)
+	     | ((uint32_t)frame->data[5] << 24);
+	time += (uint32_t)((((uint32_t)(node_ticks_t)(now - at)) * 1000) / NODE_TICKS_PER_ms) + NODE_GATEWAY_FRAME_us;
+	frame->data[2] = (uint8_t)(time & 0xff);
+	frame->data[3] = (uint8_t)((time >> 8) & 0xff);
+	frame->data[4] = (uint8_t)((time >> 16) & 0xff);
+	frame->data[5] = (uint8_t)((time >> 24) & 0xff);
+}
+
+#ifdef NODE_GATEWAY_BENCH
+static int bench_send(uint8_t seg, uint16_t count)
+{
+	uint16_t      loop;
+	node_ticks_t  now;
+	node_ticks_t  latency;
+
+	now = node_ticks();
+	for(loop = 0; loop < count; loop++) {
+		latency = now - queues[seg].entries[(atomic_load_explicit(&queues[seg].tail, memory_order_relaxed) + loop) & QUEUE_MASK].at;
+		if(latency > bench_latency_max) bench_latency_max = latency;
+		bench_latency_total += latency;
+	}
+	bench_forwarded[seg] += count;
+	return(count);
+}
+#endif
+
+/*
+ * Writes up to a batch of seg's queue to the far segment. Frames are only
+ * taken off the queue once the far interface has accepted them.
+ */
+static void forward_queue(uint8_t seg)
+{
+	struct gateway_queue  *queue = &queues[seg];
+	uint32_t               tail;
+	uint32_t               head;
+	uint16_t               count;
+	uint16_t               loop;
+	int                    sent;
+	node_ticks_t           now;
+
+	tail  = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+	head  = atomic_load_explicit(&queue->head, memory_order_acquire);
+	count = (head - tail > NODE_GATEWAY_BATCH) ? NODE_GATEWAY_BATCH : (uint16_t)(head - tail);
+	if(count == 0) return;
+
+#ifdef NODE_GATEWAY_BENCH
+	if(bench_sink) {
+		sent = bench_send(seg, count);
+		atomic_store_explicit(&queue->tail, tail + sent, memory_order_release);
+		return;
+	}
+#endif
+	now = node_ticks();
+	for(loop = 0; loop < count; loop++) {
+		tx_frames[loop] = queue->entries[(tail + loop) & QUEUE_MASK].frame;
+		retime(&tx_frames[loop], queue->entries[(tail + loop) & QUEUE_MASK].at, now);
+	}
+
+	sent = sendmmsg(sockets[seg ^ 0x01], tx_msgs, count, MSG_DONTWAIT);
+	if(sent <= 0) return;
+
+	atomic_store_explicit(&queue->tail, tail + sent, memory_order_release);
+}
+
+void gateway_tasks(void)
+{
+	uint8_t   seg;
+	uint32_t  dropped;
+
+	for(seg = 0; seg < SEGMENTS; seg++) {
+		forward_queue(seg);
+
+		dropped = atomic_load_explicit(&overflow[seg], memory_order_relaxed);
+		if(dropped != overflow_logged[seg]) {
+			overflow_logged[seg] = dropped;
+			LOG_W("%s queue full, %lu frames dropped\n\r", names[seg], (unsigned long)overflow_logged[seg]);
+		}
+	}
+}
+
+static void *rx_thread(void *arg)
+{
+	uint8_t             seg = (uint8_t)(uintptr_t)arg;
+	struct can_frame    frames[NODE_GATEWAY_BATCH];
+	struct iovec        iov[NODE_GATEWAY_BATCH];
+	struct mmsghdr      msgs[NODE_GATEWAY_BATCH];
+	uint16_t            loop;
+	int                 received;
+	node_ticks_t        now;
+
+	memset(msgs, 0x00, sizeof(msgs));
+	for(loop = 0; loop < NODE_GATEWAY_BATCH; loop++) {
+		iov[loop].iov_base             = &frames[loop];
+		iov[loop].iov_len              = sizeof(struct can_frame);
+		msgs[loop].msg_hdr.msg_iov     = &iov[loop];
+		msgs[loop].msg_hdr.msg_iovlen  = 1;
+	}
+
+	while(TRUE) {
+		received = recvmmsg(sockets[seg], msgs, NODE_GATEWAY_BATCH, MSG_WAITFORONE, NULL);
+		if(received <= 0) {
+			if(errno == EINTR) continue;
+			LOG_E("%s read failed %d\n\r", names[seg], errno);
+			return(NULL);
+		}
+
+		now = node_ticks();
+		for(loop = 0; loop < received; loop++) {
+			if(gateway_rx(seg, &frames[loop], now) < 0) {
+				atomic_fetch_add_explicit(&overflow[seg], 1, memory_order_relaxed);
+			}
+		}
+	}
+	return(NULL);
+}
+
+static int open_socket(const char *name)
+{
+	int                  fd;
+	struct ifreq         ifr;
+	struct sockaddr_can  addr;
+	struct can_filter    filter;
+
+	fd = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+	if(fd < 0) return(-1);
+
+	memset(&ifr, 0x00, sizeof(ifr));
+	strncpy(ifr.ifr_name, name, IFNAMSIZ - 1);
+	if(ioctl(fd, SIOCGIFINDEX, &ifr) < 0) {
+		close(fd);
+		return(-1);
+	}
+
+	/*
+	 * 11 bit frames only, the kernel drops the rest
+	 */
+	filter.can_id   = 0;
+	filter.can_mask = CAN_EFF_FLAG;
+	setsockopt(fd, SOL_CAN_RAW, CAN_RAW_FILTER, &filter, sizeof(filter));
+
+	memset(&addr, 0x00, sizeof(addr));
+	addr.can_family  = AF_CAN;
+	addr.can_ifindex = ifr.ifr_ifindex;
+	if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		close(fd);
+		return(-1);
+	}
+	return(fd);
+}
+
+static void gateway_tables_init(void)
+{
+	uint16_t  loop;
+
+	for(loop = 0; loop < NODES_NUM; loop++) {
+		atomic_store_explicit(&node_segment[loop], NODE_UNKNOWN, memory_order_relaxed);
+	}
+	memset(subscribed, 0x00, sizeof(subscribed));
+	for(loop = 0; loop < SEGMENTS; loop++) {
+		atomic_store_explicit(&queues[loop].head, 0, memory_order_relaxed);
+		atomic_store_explicit(&queues[loop].tail, 0, memory_order_relaxed);
+		filtered[loop]        = 0;
+		atomic_store_explicit(&overflow[loop], 0, memory_order_relaxed);
+		overflow_logged[loop] = 0;
+	}
+
+	pthread_mutex_lock(&compile_lock);
+	for(loop = 0; loop < TYPES_NUM; loop++) compile_type((uint8_t)loop);
+	pthread_mutex_unlock(&compile_lock);
+}
+
+result_t gateway_init(void)
+{
+	uint8_t  seg;
+	uint16_t loop;
+
+	names[0] = getenv("NODE_GATEWAY_IF_A");
+	if(!names[0]) names[0] = "can0";
+	names[1] = getenv("NODE_GATEWAY_IF_B");
+	if(!names[1]) names[1] = "can1";
+
+	gateway_tables_init();
+
+	memset(tx_msgs, 0x00, sizeof(tx_msgs));
+	for(loop = 0; loop < NODE_GATEWAY_BATCH; loop++) {
+		tx_iov[loop].iov_base             = &tx_frames[loop];
+		tx_iov[loop].iov_len              = sizeof(struct can_frame);
+		tx_msgs[loop].msg_hdr.msg_iov     = &tx_iov[loop];
+		tx_msgs[loop].msg_hdr.msg_iovlen  = 1;
+	}
+
+	for(seg = 0; seg < SEGMENTS; seg++) {
+		sockets[seg] = open_socket(names[seg]);
+		if(sockets[seg] < 0) {
+			LOG_E("Failed to open %s\n\r", names[seg]);
+			return(-ERR_GENERAL_ERROR);
+		}
+	}
+	for(seg = 0; seg < SEGMENTS; seg++) {
+		if(pthread_create(&threads[seg], NULL, rx_thread, (void *)(uintptr_t)seg) != 0) {
+			LOG_E("Failed to start %s thread\n\r", names[seg]);
+			return(-ERR_GENERAL_ERROR);
+		}
+	}
+	LOG_I("Gateway %s <-> %s\n\r", names[0], names[1]);
+	return(0);
+}
+
+#ifdef NODE_GATEWAY_BENCH
+/*
+ * Segment A has the Controller, node 0x00, Switch Output nodes 1 to 3 and
+ * Switch nodes 4 to 7 on it, segment B Switch Output nodes 8 to 11 and
+ * Switch nodes 12 to 15. Output nodes are only located by the state they
+ * announce on connect. A's traffic is outputs to the output nodes, inputs
+ * from its own Switch nodes and the odd group output. B's is inputs and,
+ * as A's stats requests are answered, stats replies. Frames are stamped as
+ * they'd be read, and the bench sink takes the place of the far interface.
+ */
+#define BENCH_FRAMES        200000
+#define BENCH_FRAME_us         500     // 250K bus, 8 byte frames, both ways
+
+struct bench_source {
+	uint8_t       seg;
+	uint32_t      frames;
+	uint32_t      interval_us;
+	_Atomic int   done;
+};
+
+static uint16_t bench_id(uint8_t priority, uint8_t type, boolean rtr)
+{
+	union es_control_id  es_id;
+
+	es_id.word            = 0x0000;
+	es_id.fields.priority = priority;
+	es_id.fields.es_type  = type;
+	return(es_id.word | (rtr ? ESC_RTR_MASK : 0));
+}
+
+static void bench_frame(uint8_t seg, uint32_t n, struct can_frame *frame)
+{
+	union bool_431  es_bool;
+	uint8_t         node;
+
+	memset(frame, 0x00, sizeof(struct can_frame));
+	node = (seg == 0) ? (uint8_t)(n % 16) : (uint8_t)(12 + (n % 4));
+
+	es_bool.byte             = 0x00;
+	es_bool.bitfield.node    = node;
+	es_bool.bitfield.chan    = n % 8;
+	es_bool.bitfield.es_bool = n & 0x01;
+
+	if(seg == 0) {
+		switch(n % 8) {
+		case 0:
+		case 1:
+		case 2:
+		case 3:
+			frame->can_id  = bench_id(0, ESC_BOOL_431_OUTPUT, FALSE);
+			frame->can_dlc = 1;
+			frame->data[0] = es_bool.byte;
+			break;
+		case 4:
+		case 5:
+		case 6:
+			es_bool.bitfield.node = 4 + (n % 4);
+			frame->can_id  = bench_id(ESC_PRIORITY_3, ESC_BOOL_431_INPUT, FALSE);
+			frame->can_dlc = 1;
+			frame->data[0] = es_bool.byte;
+			break;
+		default:
+			frame->can_id  = bench_id(0, ESC_GROUP_OUTPUT, FALSE);
+			frame->can_dlc = 1;
+			frame->data[0] = (uint8_t)(n & NODE_GROUP_MASK);
+			break;
+		}
+	} else {
+		if(n % 4) {
+			frame->can_id  = bench_id(ESC_PRIORITY_3, ESC_BOOL_431_INPUT, FALSE);
+			frame->can_dlc = 1;
+			frame->data[0] = es_bool.byte;
+		} else {
+			frame->can_id  = bench_id(ESC_PRIORITY_3, ESC_NODE_STATS, FALSE);
+			frame->can_dlc = 8;
+			frame->data[0] = node;
+		}
+	}
+}
+
+static void *bench_thread(void *arg)
+{
+	struct bench_source  *source = (struct bench_source *)arg;
+	struct can_frame      frame;
+	uint32_t              n;
+	node_ticks_t          start;
+	node_ticks_t          due;
+
+	start = node_ticks();
+	for(n = 0; n < source->frames; n++) {
+		bench_frame(source->seg, n, &frame);
+		if(source->interval_us) {
+			due = start + (node_ticks_t)(((uint64_t)n * source->interval_us * NODE_TICKS_PER_ms) / 1000);
+			while((int32_t)(node_ticks() - due) < 0) usleep(50);
+		}
+		while(gateway_rx(source->seg, &frame, node_ticks()) < 0) sched_yield();
+	}
+	atomic_store(&source->done, 1);
+	return(NULL);
+}
+
+static void bench_learn(void)
+{
+	struct can_frame  frame;
+	union bool_431    es_bool;
+	uint8_t           node;
+	uint8_t           chan;
+
+	memset(&frame, 0x00, sizeof(frame));
+	frame.can_id  = bench_id(ESC_PRIORITY_3, ESC_CONTROLLER_HEARTBEAT, FALSE);
+	frame.can_dlc = 2;
+	frame.data[0] = 0x00;
+	gateway_rx(0, &frame, node_ticks());
+
+	frame.can_id  = bench_id(ESC_PRIORITY_3, ESC_NODE_STATS, TRUE);
+	frame.can_dlc = 1;
+	gateway_rx(0, &frame, node_ticks());
+
+	/*
+	 * Output nodes announce their state as they connect
+	 */
+	frame.can_id  = bench_id(ESC_PRIORITY_3, ESC_BOOL_431_OUTPUT, FALSE);
+	frame.can_dlc = 4;
+	for(node = 1; node < 12; node++) {
+		if((node > 3) && (node < 8)) continue;
+
+		for(chan = 0; chan < frame.can_dlc; chan++) {
+			es_bool.byte          = 0x00;
+			es_bool.bitfield.node = node;
+			es_bool.bitfield.chan = chan;
+			frame.data[chan]      = es_bool.byte;
+		}
+		gateway_rx((node < 8) ? 0 : 1, &frame, node_ticks());
+	}
+	while((atomic_load(&queues[0].head) != atomic_load(&queues[0].tail))
+	   || (atomic_load(&queues[1].head) != atomic_load(&queues[1].tail))) gateway_tasks();
+}
+
+static void bench_run(const char *label, uint32_t frames, uint32_t interval_us)
+{
+	struct bench_source  sources[SEGMENTS];
+	pthread_t            producers[SEGMENTS];
+	uint8_t              seg;
+	uint32_t             forwarded;
+	node_ticks_t         start;
+	node_ticks_t         elapsed;
+
+	gateway_tables_init();
+	bench_forwarded[0]  = 0;
+	bench_forwarded[1]  = 0;
+	bench_learn();
+	bench_forwarded[0]  = 0;
+	bench_forwarded[1]  = 0;
+	filtered[0]         = 0;
+	filtered[1]         = 0;
+	bench_latency_max   = 0;
+	bench_latency_total = 0;
+
+	start = node_ticks();
+	for(seg = 0; seg < SEGMENTS; seg++) {
+		sources[seg].seg         = seg;
+		sources[seg].frames      = frames;
+		sources[seg].interval_us = interval_us;
+		atomic_store(&sources[seg].done, 0);
+		pthread_create(&producers[seg], NULL, bench_thread, &sources[seg]);
+	}
+	while(!atomic_load(&sources[0].done) || !atomic_load(&sources[1].done)
+	   || (atomic_load(&queues[0].head) != atomic_load(&queues[0].tail))
+	   || (atomic_load(&queues[1].head) != atomic_load(&queues[1].tail))) {
+		gateway_tasks();
+		/*
+		 * Receive threads would be blocked in recvmmsg() here, so
+		 * let the simulated ones run
+		 */
+		if((atomic_load(&queues[0].head) == atomic_load(&queues[0].tail))
+		   && (atomic_load(&queues[1].head) == atomic_load(&queues[1].tail))) sched_yield();
+	}
+	elapsed = node_ticks() - start;
+	for(seg = 0; seg < SEGMENTS; seg++) pthread_join(producers[seg], NULL);
+
+	forwarded = bench_forwarded[0] + bench_forwarded[1];
+	LOG_I("%s: A->B %lu of %lu, B->A %lu of %lu forwarded, %lu frames/s, latency avg %luus max %luus\n\r",
+	      label,
+	      (unsigned long)bench_forwarded[0], (unsigned long)frames,
+	      (unsigned long)bench_forwarded[1], (unsigned long)frames,
+	      (unsigned long)(((uint64_t)frames * SEGMENTS * 1000 * NODE_TICKS_PER_ms) / (elapsed ? elapsed : 1)),
+	      (unsigned long)(forwarded ? ((bench_latency_total * 1000) / NODE_TICKS_PER_ms) / forwarded : 0),
+	      (unsigned long)((bench_latency_max * 1000) / NODE_TICKS_PER_ms));
+}
+
+void gateway_bench(void)
+{
+	names[0]   = "A";
+	names[1]   = "B";
+	bench_sink = TRUE;
+
+	bench_run("Flat out", BENCH_FRAMES, 0);
+	bench_run("250K bus", 2000, BENCH_FRAME_us);
+
+	bench_sink = FALSE;
+}
+#endif // NODE_GATEWAY_BENCH
+
+#endif // NODE_GATEWAY
@@ -0,0 +1,50 @@
+/**
+ * @file host/gateway.h
+ *
+ * @author John Whitmore
+ *
+ * @brief Gateway between two CAN segments for host builds
+ *
+ * Copyright 2018 electronicSoup
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the version 3 of the GNU General Public License
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#ifndef _GATEWAY_H
+#define _GATEWAY_H
+
+#ifdef NODE_GATEWAY
+/*
+ * Bridges the Linux CAN interfaces named by the NODE_GATEWAY_IF_A and
+ * NODE_GATEWAY_IF_B environment variables (default can0 and can1),
+ * forwarding only the ES Control frames wanted on the far segment.
+ *
+ * A thread per segment reads frames, learns from them and queues those to
+ * be forwarded. gateway_tasks(), called from the main loop, writes queued
+ * frames to the far segment, so forwarding latency is at most a main loop
+ * pass once the far interface has room.
+ */
+extern result_t gateway_init(void);
+extern void     gateway_tasks(void);
+
+#ifdef NODE_GATEWAY_BENCH
+/*
+ * Forwarding throughput and latency between two simulated segments, with
+ * a Controller on one and Switch nodes on both, flat out and at the frame
+ * rate of a 250K bus.
+ */
+extern void     gateway_bench(void);
+#endif
+#endif // NODE_GATEWAY
+
+#endif // _GATEWAY_H
@@ -0,0 +1,363 @@
+/**
+ * @file host/socketcan.c
+ *
+ * @author John Whitmore
+ *
+ * @brief SocketCAN Layer 2 backend for host builds
+ *
+ * Copyright 2018 electronicSoup
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the version 3 of the GNU General Public License
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+/*
+ * recvmmsg() and sendmmsg() are GNU extensions, defined before any system
+ * header is pulled in
+ */
+#define _GNU_SOURCE
+#include "libesoup_config.h"
+
+#ifdef NODE_SOCKETCAN
+
+#if !defined(__RPI)
+#error "SocketCAN is for host (__RPI) builds"
+#endif
+#if defined(NODE_REPLAY)
+#error "NODE_SOCKETCAN and NODE_REPLAY both replace the CAN Bus"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <linux/can.h>
+#include <linux/can/raw.h>
+
+#ifdef SYS_SERIAL_LOGGING
+#define DEBUG_FILE
+static const char *TAG = "SocketCAN";
+#include "libesoup/logger/serial_log.h"
+#endif // SYS_SERIAL_LOGGING
+
+#include "libesoup/errno.h"
+#include "libesoup/comms/can/can.h"
+#include "libesoup/status/status.h"
+
+#include "node_ticks.h"
+#include "node_jobs.h"
+#include "timer_wheel.h"
+#include "node_can.h"
+#include "node_stats.h"
+#include "host/socketcan.h"
+
+#define RX_CONTROL_SIZE   CMSG_SPACE(sizeof(uint32_t))
+
+static int                 can_socket = -1;
+
+static struct can_filter   filters[NODE_CAN_HANDLER_ARRAY_SIZE];
+static uint8_t             num_filters = 0;
+
+static struct can_frame    rx_frames[NODE_SOCKETCAN_BATCH];
+static struct iovec        rx_iov[NODE_SOCKETCAN_BATCH];
+static struct mmsghdr      rx_msgs[NODE_SOCKETCAN_BATCH];
+static uint8_t             rx_control[NODE_SOCKETCAN_BATCH][RX_CONTROL_SIZE];
+
+static struct can_frame    tx_frames[NODE_SOCKETCAN_BATCH];
+static struct iovec        tx_iov[NODE_SOCKETCAN_BATCH];
+static struct mmsghdr      tx_msgs[NODE_SOCKETCAN_BATCH];
+static uint16_t            tx_count = 0;
+
+static void to_linux(can_frame *frame, struct can_frame *linux_frame)
+{
+	memset(linux_frame, 0x00, sizeof(struct can_frame));
+	linux_frame->can_id  = frame->can_id;
+	linux_frame->can_dlc = (frame->can_dlc > CAN_MAX_DLEN) ? CAN_MAX_DLEN : frame->can_dlc;
+	memcpy(linux_frame->data, frame->data, linux_frame->can_dlc);
+}
+
+static void from_linux(struct can_frame *linux_frame, can_frame *frame)
+{
+	frame->can_id  = linux_frame->can_id;
+	frame->can_dlc = linux_frame->can_dlc;
+	memcpy(frame->data, linux_frame->data, CAN_MAX_DLEN);
+}
+
+static void setup_batches(void)
+{
+	uint16_t  loop;
+
+	memset(rx_msgs, 0x00, sizeof(rx_msgs));
+	memset(tx_msgs, 0x00, sizeof(tx_msgs));
+	for(loop = 0; loop < NODE_SOCKETCAN_BATCH; loop++) {
+		rx_iov[loop].iov_base                 = &rx_frames[loop];
+		rx_iov[loop].iov_len                  = sizeof(struct can_frame);
+		rx_msgs[loop].msg_hdr.msg_iov         = &rx_iov[loop];
+		rx_msgs[loop].msg_hdr.msg_iovlen      = 1;
+		rx_msgs[loop].msg_hdr.msg_control     = rx_control[loop];
+		rx_msgs[loop].msg_hdr.msg_controllen  = RX_CONTROL_SIZE;
+
+		tx_iov[loop].iov_base                 = &tx_frames[loop];
+		tx_iov[loop].iov_len                  = sizeof(struct can_frame);
+		tx_msgs[loop].msg_hdr.msg_iov         = &tx_iov[loop];
+		tx_msgs[loop].msg_hdr.msg_iovlen      = 1;
+	}
+}
+
+static int open_socket(const char *name)
+{
+	int                  fd;
+	struct ifreq         ifr;
+	struct sockaddr_can  addr;
+
+	fd = socket(PF_CAN, SOCK_RAW | SOCK_NONBLOCK, CAN_RAW);
+	if(fd < 0) return(-1);
+
+	memset(&ifr, 0x00, sizeof(ifr));
+	strncpy(ifr.ifr_name, name, IFNAMSIZ - 1);
+	if(ioctl(fd, SIOCGIFINDEX, &ifr) < 0) {
+		close(fd);
+		return(-1);
+	}
+
+	memset(&addr, 0x00, sizeof(addr));
+	addr.can_family  = AF_CAN;
+	addr.can_ifindex = ifr.ifr_ifindex;
+	if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		close(fd);
+		return(-1);
+	}
+	return(fd);
+}
+
+/*
+ * An empty filter list receives nothing, which is right for a Node with
+ * no handlers registered
+ */
+static void apply_filters(void)
+{
+	if(can_socket < 0) return;
+
+	if(setsockopt(can_socket, SOL_CAN_RAW, CAN_RAW_FILTER, filters, num_filters * sizeof(struct can_filter)) < 0) {
+		LOG_E("CAN_RAW_FILTER failed %d\n\r", errno);
+	}
+}
+
+void socketcan_filter(uint8_t index, uint16_t filter, uint16_t mask)
+{
+	if(index >= NODE_CAN_HANDLER_ARRAY_SIZE) return;
+
+	/*
+	 * Node handlers only take 11 bit frames, so the EFF flag is always
+	 * part of the match
+	 */
+	filters[index].can_id   = filter & mask;
+	filters[index].can_mask = mask | CAN_EFF_FLAG;
+	if(index >= num_filters) num_filters = index + 1;
+
+	apply_filters();
+}
+
+result_t socketcan_init(status_handler_t handler)
+{
+	const char  *name;
+	int          enable = 1;
+
+	name = getenv("NODE_CAN_IF");
+	if(!name) name = "can0";
+
+	can_socket = open_socket(name);
+	if(can_socket < 0) {
+		LOG_E("Failed to open %s\n\r", name);
+		return(-ERR_GENERAL_ERROR);
+	}
+
+	/*
+	 * Kernel receive queue overflow count for the dropped frames counter
+	 */
+	setsockopt(can_socket, SOL_SOCKET, SO_RXQ_OVFL, &enable, sizeof(enable));
+
+	setup_batches();
+	apply_filters();
+
+	handler(can_bus_l2_status, can_l2_connected, baud_250K);
+	return(0);
+}
+
+static void flush_tx(void)
+{
+	int       sent;
+	uint16_t  loop;
+
+	if(tx_count == 0) return;
+
+	sent = sendmmsg(can_socket, tx_msgs, tx_count, MSG_DONTWAIT);
+	if(sent <= 0) return;
+
+	/*
+	 * Frames the interface's queue couldn't take go first next time
+	 */
+	for(loop = sent; loop < tx_count; loop++) {
+		tx_frames[loop - sent] = tx_frames[loop];
+	}
+	tx_count -= sent;
+}
+
+result_t socketcan_tx_frame(can_frame *frame)
+{
+	if(tx_count == NODE_SOCKETCAN_BATCH) flush_tx();
+	if(tx_count == NODE_SOCKETCAN_BATCH) return(-ERR_NO_RESOURCES);
+
+	to_linux(frame, &tx_frames[tx_count++]);
+	return(0);
+}
+
+#ifdef NODE_STATS
+static void rx_overflow(struct msghdr *msg)
+{
+	struct cmsghdr  *cmsg;
+	uint32_t         dropped;
+
+	for(cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		if((cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SO_RXQ_OVFL)) {
+			memcpy(&dropped, CMSG_DATA(cmsg), sizeof(dropped));
+			node_stats.rx_dropped = (dropped > 0xffff) ? 0xffff : (uint16_t)dropped;
+		}
+	}
+}
+#endif
+
+void socketcan_tasks(void)
+{
+	int             received;
+	uint16_t        loop;
+	can_frame       frame;
+	struct pollfd   fds;
+
+	flush_tx();
+
+	received = recvmmsg(can_socket, rx_msgs, NODE_SOCKETCAN_BATCH, MSG_DONTWAIT, NULL);
+	if(received <= 0) {
+		/*
+		 * Nothing waiting so sleep until there is, or until the next
+		 * timer tick is due, rather than spin. Not if jobs or timers
+		 * are waiting to run, they'd be held up by the wait every pass.
+		 */
+#ifdef NODE_JOBS
+		if(node_jobs_waiting()) return;
+#endif
+#ifdef TIMER_WHEEL
+		if(timer_wheel_due()) return;
+#endif
+		fds.fd      = can_socket;
+		fds.events  = (tx_count) ? (POLLIN | POLLOUT) : POLLIN;
+		fds.revents = 0;
+		poll(&fds, 1, NODE_SOCKETCAN_IDLE_ms);
+		return;
+	}
+
+#ifdef NODE_STATS
+	node_stats_rx_ring_level(received);
+	rx_overflow(&rx_msgs[received - 1].msg_hdr);
+#endif
+	for(loop = 0; loop < received; loop++) {
+		from_linux(&rx_frames[loop], &frame);
+		node_can_rx_frame(&frame);
+		rx_msgs[loop].msg_hdr.msg_controllen = RX_CONTROL_SIZE;
+	}
+}
+
+#ifdef NODE_SOCKETCAN_BENCH
+#define BENCH_FRAMES    100000
+
+static uint32_t bench_single(int tx, int rx)
+{
+	uint32_t           loop;
+	uint32_t           received = 0;
+	struct can_frame   frame;
+	node_ticks_t       start;
+
+	memset(&frame, 0x00, sizeof(frame));
+	frame.can_id  = 0x100;
+	frame.can_dlc = 8;
+
+	start = node_ticks();
+	for(loop = 0; loop < BENCH_FRAMES; loop++) {
+		frame.data[0] = (uint8_t)loop;
+		while(write(tx, &frame, sizeof(frame)) < 0) {
+			while(read(rx, &frame, sizeof(frame)) > 0) received++;
+		}
+		while(read(rx, &frame, sizeof(frame)) > 0) received++;
+	}
+	while(read(rx, &frame, sizeof(frame)) > 0) received++;
+	LOG_I("read/write: %lu frames %luus\n\r", (unsigned long)received, (unsigned long)(node_ticks() - start));
+	return(received);
+}
+
+static uint32_t bench_batched(int tx, int rx)
+{
+	uint32_t      loop;
+	uint16_t      fill;
+	int           rc;
+	uint32_t      received = 0;
+	node_ticks_t  start;
+
+	for(fill = 0; fill < NODE_SOCKETCAN_BATCH; fill++) {
+		memset(&tx_frames[fill], 0x00, sizeof(struct can_frame));
+		tx_frames[fill].can_id  = 0x100;
+		tx_frames[fill].can_dlc = 8;
+	}
+
+	start = node_ticks();
+	for(loop = 0; loop < BENCH_FRAMES; loop += fill) {
+		fill = 0;
+		do {
+			rc = sendmmsg(tx, &tx_msgs[fill], NODE_SOCKETCAN_BATCH - fill, MSG_DONTWAIT);
+			if(rc > 0) fill += rc;
+			while((rc = recvmmsg(rx, rx_msgs, NODE_SOCKETCAN_BATCH, MSG_DONTWAIT, NULL)) > 0) received += rc;
+		} while(fill < NODE_SOCKETCAN_BATCH);
+	}
+	while((rc = recvmmsg(rx, rx_msgs, NODE_SOCKETCAN_BATCH, MSG_DONTWAIT, NULL)) > 0) received += rc;
+	LOG_I("mmsg x%d: %lu frames %luus\n\r", NODE_SOCKETCAN_BATCH, (unsigned long)received, (unsigned long)(node_ticks() - start));
+	return(received);
+}
+
+void socketcan_bench(void)
+{
+	int          tx;
+	int          rx;
+	const char  *name;
+
+	name = getenv("NODE_CAN_IF");
+	if(!name) name = "vcan0";
+
+	tx = open_socket(name);
+	rx = open_socket(name);
+	if((tx < 0) || (rx < 0)) {
+		LOG_E("Bench needs %s\n\r", name);
+		return;
+	}
+	setup_batches();
+
+	bench_single(tx, rx);
+	bench_batched(tx, rx);
+
+	close(tx);
+	close(rx);
+}
+#endif // NODE_SOCKETCAN_BENCH
+
+#endif // NODE_SOCKETCAN
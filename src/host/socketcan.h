@@ -0,0 +1,56 @@
+/**
+ * @file host/socketcan.h
+ *
+ * @author John Whitmore
+ *
+ * @brief SocketCAN Layer 2 backend for host builds
+ *
+ * Copyright 2018 electronicSoup
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the version 3 of the GNU General Public License
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#ifndef _SOCKETCAN_H
+#define _SOCKETCAN_H
+
+#ifdef NODE_SOCKETCAN
+/*
+ * Runs the Node on a Linux CAN interface, named by the NODE_CAN_IF
+ * environment variable (default can0), in place of the libesoup L2 driver.
+ *
+ * Received frames are read NODE_SOCKETCAN_BATCH at a time with recvmmsg()
+ * and passed to node_can_rx_frame(). Transmitted frames are queued and
+ * written with sendmmsg() on the next socketcan_tasks(). The kernel filters
+ * frames against the Node's handler table, node_can passing each
+ * registration on through socketcan_filter(), so frames no handler wants
+ * never wake the process.
+ *
+ * socketcan_init() reports can_l2_connected to the status handler once the
+ * socket is bound, so it is called after the Node's handlers are in place.
+ */
+extern result_t socketcan_init(status_handler_t handler);
+extern void     socketcan_tasks(void);
+extern result_t socketcan_tx_frame(can_frame *frame);
+extern void     socketcan_filter(uint8_t index, uint16_t filter, uint16_t mask);
+
+#ifdef NODE_SOCKETCAN_BENCH
+/*
+ * Frames per second through the interface with a read()/write() per frame
+ * and with recvmmsg()/sendmmsg() batches. Run on a vcan interface, where
+ * a second socket sees the frames the first sends.
+ */
+extern void     socketcan_bench(void);
+#endif
+#endif // NODE_SOCKETCAN
+
+#endif // _SOCKETCAN_H
@@ -50,13 +50,21 @@
 //#define SYS_SERIAL_LOGGING_BAUD           76800
 //#define SYS_SERIAL_LOGGING_BAUD           115200
 
+#if defined(__18F4585)
+#define SYS_UART_TX_BUFFER_SIZE 64
+#else
 #define SYS_UART_TX_BUFFER_SIZE 300
+#endif
 
 #endif // defined(SYS_SERIAL_LOGGING)
 
 #define SYS_HW_TIMERS
 #define SYS_SW_TIMERS
+#if defined(__18F4585)
+#define SYS_NUMBER_OF_SW_TIMERS     4
+#else
 #define SYS_NUMBER_OF_SW_TIMERS    10
+#endif
 #define SYS_SW_TIMER_TICK_ms        5
 
 /*
@@ -78,6 +86,13 @@
  */
 #define SYS_RAND
 
+/*
+ * ADC driver for the ADC application, the host build simulates its inputs
+ */
+#if defined(APP_ADC) && !defined(__RPI)
+#define SYS_ADC
+#endif
+
 /*
  * CAN Bus depends on System Status Code
  */
@@ -88,9 +103,19 @@
  */
 #define SYS_CAN_BUS
 #ifdef SYS_CAN_BUS
-#define SYS_CAN_FRAME_HANDLER_ARRAY_SIZE     10
+/*
+ * The Node registers a single frame handler with libesoup, see node_can.h,
+ * the rest of the table is for libesoup's own protocols.
+ */
+#if defined(__18F4585)
+#define SYS_CAN_FRAME_HANDLER_ARRAY_SIZE      2
+#define SYS_CAN_L2_HANDLER_ARRAY_SIZE         2
+#define SYS_CAN_RX_CIR_BUFFER_SIZE            3
+#else
+#define SYS_CAN_FRAME_HANDLER_ARRAY_SIZE      4
 #define SYS_CAN_L2_HANDLER_ARRAY_SIZE         5
 #define SYS_CAN_RX_CIR_BUFFER_SIZE            5
+#endif
 //#define SYS_CAN_PING_PROTOCOL_PEER_TO_PEER
 #define SYS_CAN_PING_PROTOCOL_CENTRALISED_MASTER
 //#define SYS_CAN_PING_PROTOCOL_CENTRALISED_SLAVE
@@ -136,6 +161,214 @@
 #define EEPROM_NODE_IO_ADDRESS              0x01
 #define EEPROM_NODE_CAN_BAUD_RATE_ADDR      0x02
 #define EEPROM_NODE_L3_ADDRESS              0x03
+#define EEPROM_NODE_WDT_RESETS_ADDR         0x04
+#define EEPROM_NODE_APPS_ADDR               0x05     // Bit mask, see app.h
+#define EEPROM_NODE_GROUPS_ADDR             0x06     // NODE_GROUPS_NUM Bytes
+#define EEPROM_SW_OUTPUT_JOURNAL_ADDR       0x26     // 2 x SW_OUTPUT_JOURNAL_SLOTS Bytes
+
+/*
+ * Node CAN Frame handler table, see node_can.h. Room on the PIC18 for
+ * main's own handler, stats, trace, bus time and a Switch Output with
+ * timed and group outputs, a handler each.
+ */
+#if defined(__18F4585)
+#define NODE_CAN_HANDLER_ARRAY_SIZE          7
+#else
+#define NODE_CAN_HANDLER_ARRAY_SIZE         10
+#endif
+
+/*
+ * Health and performance counters, see node_stats.h
+ */
+#define NODE_STATS
+
+/*
+ * Timer wheel for the Node's own timers, see timer_wheel.h. Wheel covers
+ * SLOTS ^ LEVELS ticks before timers have to be cascaded again.
+ */
+#define TIMER_WHEEL
+#ifdef TIMER_WHEEL
+#define TIMER_WHEEL_TICK_ms                  SYS_SW_TIMER_TICK_ms
+//#define TIMER_WHEEL_TICKLESS
+#if defined(__18F4585)
+#define TIMER_WHEEL_SLOT_BITS                4
+#define TIMER_WHEEL_LEVELS                   2
+#else
+#define TIMER_WHEEL_SLOT_BITS                6
+#define TIMER_WHEEL_LEVELS                   3
+#endif
+//#define TIMER_WHEEL_BENCH
+#ifdef TIMER_WHEEL_BENCH
+#define TIMER_WHEEL_BENCH_TIMERS           256
+#endif
+#endif // TIMER_WHEEL
+
+/*
+ * Cooperative jobs, see node_jobs.h. Each pass of the main loop gives jobs
+ * up to the budget, plus however long the last slice overruns it.
+ */
+#define NODE_JOBS
+#ifdef NODE_JOBS
+#define NODE_JOBS_BUDGET_us               1000
+//#define NODE_JOBS_BENCH
+#endif
+
+/*
+ * Trace points, see node_trace.h
+ */
+//#define NODE_TRACE
+#ifdef NODE_TRACE
+#if defined(__18F4585)
+#define NODE_TRACE_BUFFER_SIZE              16
+#else
+#define NODE_TRACE_BUFFER_SIZE             128
+#endif
+//#define NODE_TRACE_MAIN_LOOP
+#endif
+
+/*
+ * Bus time and timed outputs, see node_time.h. The Controller is the time
+ * master. The receive latency is the time a sync frame, 6 bytes at
+ * 250kbit/s, spends on the wire.
+ */
+//#define NODE_TIME
+#ifdef NODE_TIME
+#if defined(APP_CONTROLLER)
+#define NODE_TIME_MASTER
+#endif
+#define NODE_TIME_SYNC_ms                 1000
+#define NODE_TIME_MASTER_MISSED              3
+#define NODE_TIME_HOLDOVER_ms            10000
+#define NODE_TIME_STEP_us                 2000
+#define NODE_TIME_RX_LATENCY_us            420
+#define NODE_TIME_OUTPUT_SLOTS               8     // Timed outputs waiting
+//#define NODE_TIME_BENCH
+#ifdef NODE_TIME_BENCH
+#define NODE_TIME_BENCH_NODES               16
+#define NODE_TIME_BENCH_PPM                100
+#endif
+#endif // NODE_TIME
+
+/*
+ * Output groups, see node_groups.h. Each group costs a byte of RAM and a
+ * byte of EEPROM on every Switch Output node.
+ */
+#define NODE_GROUPS
+#ifdef NODE_GROUPS
+#define NODE_GROUPS_NUM                     32
+#endif
+
+/*
+ * Host builds only, bus capture to a file or replay of a capture in place
+ * of the CAN Bus, see host/capture.h
+ */
+#if defined(__RPI)
+//#define NODE_CAPTURE
+//#define NODE_REPLAY
+
+/*
+ * Run on a Linux CAN interface in place of the libesoup driver, see
+ * host/socketcan.h. The idle wait is kept below a timer tick.
+ */
+//#define NODE_SOCKETCAN
+#ifdef NODE_SOCKETCAN
+#define NODE_SOCKETCAN_BATCH                32
+#define NODE_SOCKETCAN_IDLE_ms               1
+//#define NODE_SOCKETCAN_BENCH
+#endif
+
+/*
+ * Bridge two Linux CAN interfaces, forwarding only the traffic wanted on
+ * the far segment, see host/gateway.h. Forwarded bus time syncs are
+ * advanced by a frame time on the source segment.
+ */
+//#define NODE_GATEWAY
+#ifdef NODE_GATEWAY
+#define NODE_GATEWAY_QUEUE                 256     // Frames each way, power of 2
+#define NODE_GATEWAY_BATCH                  32
+#define NODE_GATEWAY_FRAME_us              420
+//#define NODE_GATEWAY_BENCH
+#endif
+#endif // __RPI
+
+/*
+ * ES Control types used by the Node firmware itself. Taken from the top of
+ * the es_type space to keep clear of the types defined in es_control.h
+ */
+#define ESC_NODE_STATS                    0x7f
+#define ESC_NODE_TRACE                    0x7e
+#define ESC_ADC_INPUT                     0x7d
+#define ESC_CONTROLLER_HEARTBEAT          0x7c
+#define ESC_NODE_TIME                     0x7b
+#define ESC_TIMED_OUTPUT                  0x7a
+#define ESC_GROUP_OUTPUT                  0x79
+#define ESC_GROUP_CONFIG                  0x78     // Must be even, see node_groups.h
+
+/*
+ * ADC application, see application/ADC/adc_app.c. Values are reported when
+ * they move more than the deadband, in ADC counts, from the last value
+ * sent, or when the maximum interval has passed regardless.
+ */
+#ifdef APP_ADC
+#define ADC_NUM_CHANNELS                     4
+#define ADC_SAMPLE_ms                       10
+#define ADC_FILTER_SHIFT                     3     // IIR weight 1/8
+#define ADC_DEADBAND                         8
+#define ADC_MAX_INTERVAL_ms              5000
+#define ADC_RING_SIZE                       16
+#endif
+
+/*
+ * Switch Output state journal, see application/SW_Output/sw_output.c.
+ * Outputs are restored from EEPROM at boot, before the CAN Bus connects.
+ * Changes are written the delay after the first of them, each write to
+ * the next of the journal's slots.
+ */
+#if defined(APP_SW_OUTPUT) && defined(SYS_EEPROM)
+#define SW_OUTPUT_JOURNAL
+#ifdef SW_OUTPUT_JOURNAL
+#define SW_OUTPUT_JOURNAL_SLOTS             16
+#define SW_OUTPUT_JOURNAL_DELAY_ms        2000
+#endif
+#endif
+
+/*
+ * Controller scenes, see application/Controller/controller.c. Step delays
+ * are held in SCENE_TICK_ms units, so the longest is about 54 minutes.
+ */
+#ifdef APP_CONTROLLER
+#define SCENE_TICK_ms                       50
+//#define SCENE_BENCH
+#ifdef NODE_TIME
+#define CONTROLLER_OUTPUT_LEAD_ms           20     // Outputs sent ahead of time
+#endif
+
+/*
+ * Hot standby, more than one Controller on the bus with one driving the
+ * outputs. The others take over once the primary has been silent for
+ * CONTROLLER_FAILOVER_MISSED heartbeats.
+ */
+//#define CONTROLLER_HOT_STANDBY
+#ifdef CONTROLLER_HOT_STANDBY
+#define CONTROLLER_HEARTBEAT_ms            500
+#define CONTROLLER_HEARTBEAT_BUSY            2     // Periods between heartbeats while sending outputs
+#define CONTROLLER_FAILOVER_MISSED           3
+#endif
+
+/*
+ * Input rate limit, a token bucket for each input node. A node whose
+ * inputs are dropped QUARANTINE_DROPS times before its bucket fills again
+ * is ignored altogether for the quarantine period.
+ */
+#define CONTROLLER_RATE_LIMIT
+#ifdef CONTROLLER_RATE_LIMIT
+#define CONTROLLER_INPUT_RATE               10     // Inputs per second
+#define CONTROLLER_INPUT_BURST              16
+#define CONTROLLER_QUARANTINE_DROPS         32
+#define CONTROLLER_QUARANTINE_ms         60000
+//#define CONTROLLER_RATE_BENCH
+#endif
+#endif // APP_CONTROLLER
 
 
 
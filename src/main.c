@@ -45,9 +45,27 @@ static const char *TAG = "Main";
 #include "libesoup/status/status.h"
 
 #include "app.h"
+#include "node_ticks.h"
+#include "node_can.h"
+#include "node_jobs.h"
+#include "node_stats.h"
+#include "node_time.h"
+#include "node_trace.h"
+#include "timer_wheel.h"
+#if defined(NODE_CAPTURE) || defined(NODE_REPLAY)
+#include "host/capture.h"
+#endif
+#ifdef NODE_SOCKETCAN
+#include "host/socketcan.h"
+#endif
+#ifdef NODE_GATEWAY
+#include "host/gateway.h"
+#endif
 
 static boolean   can_connected = FALSE;
 static boolean   app_valid     = FALSE;
+static uint8_t   apps_running  = 0x00;
+static uint8_t   apps_enabled  = 0xff;
 
 static uint8_t          io_address;
 #ifdef SYS_CAN_BUS
@@ -57,8 +75,18 @@ static can_baud_rate_t  baud_rate;
 static uint8_t          l3_address;
 #endif // SYS_CAN_ISO15765
 
+#ifdef NODE_JOBS
+static struct node_job  apps_job;
+#if defined(SYS_CAN_DCNCP) && defined(SYS_EEPROM)
+static struct node_job  l3_address_job;
+#endif
+#endif
+
 void system_status_handler(status_source_t source, int16_t status, int16_t data);
 
+static void apps_init(void);
+static void apps_main(void);
+
 #ifdef SYS_CAN_BUS
 static void frame_handler(can_frame *);
 #endif
@@ -76,8 +104,35 @@ int main(void)
 //	struct period    period = {mSeconds, 500};
 #ifdef SYS_CAN_BUS
 	can_l2_target_t  target;
+#endif
+	/*
+	 * Check the reset cause before anything else touches RCON
+	 */
+#if defined(__dsPIC33EP256MU806__) || defined(__PIC24FJ256GB106__)
+	watchdog = RCONbits.WDTO;
+	RCONbits.WDTO = 0;
+#elif defined(__18F4585)
+	watchdog = !RCONbits.TO;
 #endif
 	libesoup_init();
+	node_ticks_init();
+	NODE_TRACE_POINT(TRACE_BOOT, watchdog, 0);
+#ifdef TIMER_WHEEL
+	timer_wheel_init();
+#ifdef TIMER_WHEEL_BENCH
+	timer_wheel_bench();
+#endif
+#endif
+#ifdef NODE_JOBS
+	node_jobs_init();
+	NODE_JOB_INIT(&apps_job);
+#if defined(SYS_CAN_DCNCP) && defined(SYS_EEPROM)
+	NODE_JOB_INIT(&l3_address_job);
+#endif
+#ifdef NODE_JOBS_BENCH
+	node_jobs_bench();
+#endif
+#endif
 	
 	can_connected = FALSE;
         node_status   = 0x00;
@@ -88,6 +143,7 @@ int main(void)
 	LOG_D("***   %ldMHz         ***\n\r", sys_clock_freq);
 	LOG_D("************************\n\r");
 
+#ifdef SYS_EEPROM
 	rc = eeprom_read(EEPROM_NODE_IO_ADDRESS);
 	RC_CHECK_PRINT_CONT("EEPROM Read")
 	io_address = (uint8_t)rc;
@@ -97,26 +153,38 @@ int main(void)
 		RC_CHECK_PRINT_CONT("EEPROM Write")
 		io_address = 0x01;
 	}
+#else
+	io_address = 0x01;
+#endif
 	LOG_D("Node IO Address 0x%x\n\r", io_address);
 	if(watchdog) {
 		LOG_E("Watch Dog Timed out!\n\r");
 		app_valid = FALSE;
 
+#ifdef SYS_EEPROM
 		rc = eeprom_write(EEPROM_NODE_STATUS_ADDR, node_status & ~(NODE_STATUS_APP_VALID));
 		RC_CHECK_PRINT_CONT("Failed to write to EEPROM\n\r");
+#endif
 	} else {
 		LOG_D("Application assumed good!\n\r");
+#ifdef SYS_EEPROM
 		rc = eeprom_read(EEPROM_NODE_STATUS_ADDR);
 		if(rc >= 0) {
 			node_status = (uint8_t)rc;
 			LOG_D("Node Status 0x%x\n\r", node_status);
 			app_valid = node_status & NODE_STATUS_APP_VALID;
 		}
+#else
+		/*
+		 * No EEPROM, e.g. the gauge board, so no stored status
+		 */
+		app_valid = TRUE;
+#endif
 	}
 //	rc = delay(&period);
 //	RC_CHECK_PRINT_CONT("Failed to delay\n\r");
 
-#ifdef SYS_CAN_BUS
+#if defined(SYS_CAN_BUS) && defined(SYS_EEPROM)
 	baud_rate = eeprom_read(EEPROM_NODE_CAN_BAUD_RATE_ADDR);
         if( (baud_rate >= no_baud) || (baud_rate < 0) ) {
 		baud_rate = baud_250K;
@@ -124,15 +192,27 @@ int main(void)
 		rc = eeprom_write(EEPROM_NODE_CAN_BAUD_RATE_ADDR, baud_rate);
 		RC_CHECK_PRINT_CONT("Failed to write to EEPROM\n\r");
         }
+#elif defined(SYS_CAN_BUS)
+	baud_rate = baud_250K;
 #endif
 #ifdef SYS_CAN_ISO15765
+#ifdef SYS_EEPROM
 	rc = eeprom_read(EEPROM_NODE_L3_ADDRESS);
 	RC_CHECK_PRINT_CONT("EEPROM Read")
 	l3_address = (uint8_t)rc;
+#else
+	l3_address = 0xff;
+#endif
+#endif
+#if defined(APP_SW_OUTPUT) && defined(SW_OUTPUT_JOURNAL)
+	if(app_valid) {
+		rc = sw_output_restore();
+		RC_CHECK_PRINT_CONT("Failed to restore outputs\n\r");
+	}
 #endif
 //	rc = delay(&period);
 //	RC_CHECK_PRINT_CONT("Failed to delay()\n\r");
-#ifdef SYS_CAN_BUS
+#if defined(SYS_CAN_BUS) && !defined(NODE_REPLAY) && !defined(NODE_SOCKETCAN)
 #ifdef SYS_CAN_ISO15765
  	rc = can_init(baud_rate, l3_address, system_status_handler, normal);
 	RC_CHECK_PRINT_CONT("Failed to initialise CAN Bus\n\r");
@@ -147,11 +227,63 @@ int main(void)
 	 * Register a frame handler
 	 */
 #ifdef SYS_CAN_BUS
+	rc = node_can_init();
+	RC_CHECK_PRINT_CONT("Failed to register Node dispatcher\n\r");
+#ifdef NODE_CAPTURE
+	rc = capture_init();
+	RC_CHECK_PRINT_CONT("Failed to open capture\n\r");
+#endif
+
 	target.filter = 0x555;
 	target.mask   = CAN_SFF_MASK;
 	target.handler = frame_handler;
-	rc = frame_dispatch_reg_handler(&target);
+	rc = node_can_reg_handler(&target);
 	RC_CHECK_PRINT_CONT("Failed to register frame handler\n\r");
+#endif
+#ifdef NODE_STATS
+	rc = node_stats_init(io_address, watchdog);
+	RC_CHECK_PRINT_CONT("Failed to initialise Node stats\n\r");
+#endif
+#ifdef NODE_TRACE
+	rc = node_trace_init(io_address);
+	RC_CHECK_PRINT_CONT("Failed to initialise Node trace\n\r");
+#endif
+#ifdef NODE_TIME
+	rc = node_time_init(io_address);
+	RC_CHECK_PRINT_CONT("Failed to initialise bus time\n\r");
+#ifdef NODE_TIME_BENCH
+	node_time_bench();
+#endif
+#endif
+#ifdef NODE_REPLAY
+	/*
+	 * Everything is registered so the replayed bus can "connect"
+	 */
+	rc = capture_replay_init(system_status_handler);
+	if(rc < 0) {
+		LOG_E("Failed to start replay\n\r");
+		exit(1);
+	}
+#endif
+#ifdef NODE_SOCKETCAN
+#ifdef NODE_SOCKETCAN_BENCH
+	socketcan_bench();
+#endif
+	rc = socketcan_init(system_status_handler);
+	if(rc < 0) {
+		LOG_E("Failed to open CAN interface\n\r");
+		exit(1);
+	}
+#endif
+#ifdef NODE_GATEWAY
+#ifdef NODE_GATEWAY_BENCH
+	gateway_bench();
+#endif
+	rc = gateway_init();
+	if(rc < 0) {
+		LOG_E("Failed to start gateway\n\r");
+		exit(1);
+	}
 #endif
 	/*
 	 * The applicaton is only initialised when the CAN Bus becomes active
@@ -161,8 +293,8 @@ int main(void)
 #ifndef SYS_CAN_BUS
 	if(app_valid) {
 		LOG_D("Call App Init as Application is valid\n\r");
-		rc = app_init(io_address, system_status_handler);
-		if(rc < 0) app_valid = FALSE;
+		NODE_TRACE_POINT(TRACE_APP_INIT, 0, 0);
+		apps_init();
 	}
 #endif
 	/*
@@ -173,27 +305,153 @@ int main(void)
 	while(TRUE) {
 		libesoup_tasks();
                 asm ("CLRWDT");
+		NODE_STATS_LOOP();
+#ifdef TIMER_WHEEL
+		timer_wheel_tasks();
+#endif
+#ifdef NODE_TRACE
+		node_trace_tasks();
+#endif
+#ifdef NODE_TIME
+		node_time_tasks();
+#endif
+#ifdef NODE_REPLAY
+		capture_replay_tasks();
+#endif
+#ifdef NODE_SOCKETCAN
+		socketcan_tasks();
+#endif
+#ifdef NODE_GATEWAY
+		gateway_tasks();
+#endif
 
 #ifdef SYS_CAN_BUS
 		if (app_valid && can_connected) {
-			rc = app_main();
-			if(rc < 0) app_valid = FALSE;
+			NODE_TRACE_LOOP_POINT(TRACE_APP_MAIN_BEGIN);
+			apps_main();
+			NODE_TRACE_LOOP_POINT(TRACE_APP_MAIN_END);
 		}
 #else
 		if (app_valid) {
-			rc = app_main();
-			if(rc < 0) app_valid = FALSE;
+			NODE_TRACE_LOOP_POINT(TRACE_APP_MAIN_BEGIN);
+			apps_main();
+			NODE_TRACE_LOOP_POINT(TRACE_APP_MAIN_END);
 		}
 #endif
+#ifdef NODE_JOBS
+		node_jobs_tasks();
+#endif
+	}
+}
+
+/*
+ * Initialise one application, by its bit in the application mask
+ */
+static void app_init(uint8_t app)
+{
+	result_t  rc;
+
+#define APP_INIT(name, bit, polled)                                        \
+	if((app == (bit)) && (apps_enabled & (1 << (bit)))) {              \
+		rc = name##_app_init(io_address, system_status_handler);   \
+		if(rc < 0) {                                               \
+			LOG_E(#name " init failed\n\r");                   \
+		} else {                                                   \
+			apps_running |= (1 << (bit));                      \
+		}                                                          \
+	}
+	NODE_APPS(APP_INIT)
+#undef APP_INIT
+}
+
+#ifdef NODE_JOBS
+static uint8_t apps_init_job(struct node_job *job)
+{
+	app_init((uint8_t)job->step);
+	return((job->step < 7) ? NODE_JOB_YIELD : NODE_JOB_DONE);
+}
+#endif
+
+/*
+ * Initialise each application in the image which is enabled in the EEPROM
+ * application mask, an erased mask enabling them all. With jobs each
+ * application is initialised on its own pass of the main loop, rather
+ * than all of them in the status handler.
+ */
+static void apps_init(void)
+{
+	result_t      rc __attribute__((unused));
+#ifdef NODE_JOBS
+	union sigval  data;
+#else
+	uint8_t       app;
+#endif
+
+#ifdef NODE_JOBS
+	/*
+	 * An init still under way carries on, the apps it's done already
+	 * stay running
+	 */
+	if(NODE_JOB_QUEUED(&apps_job)) return;
+#endif
+	apps_enabled = 0xff;
+#ifdef SYS_EEPROM
+	rc = eeprom_read(EEPROM_NODE_APPS_ADDR);
+	if(rc >= 0) apps_enabled = (uint8_t)rc;
+#endif
+	apps_running = 0x00;
+
+#ifdef NODE_JOBS
+	data.sival_int = 0;
+	rc = node_job_submit(&apps_job, NODE_JOB_HIGH, apps_init_job, data);
+	RC_CHECK_PRINT_VOID("Apps init job\n\r");
+#else
+	for(app = 0; app < 8; app++) {
+		app_init(app);
 	}
+#endif
+}
+
+/*
+ * An application returning an error is stopped, the others carry on
+ */
+static void apps_main(void)
+{
+	result_t  rc __attribute__((unused));
+
+#define APP_MAIN(name, bit, polled)                                        \
+	if((polled) && (apps_running & (1 << (bit)))) {                    \
+		rc = name##_app_main();                                    \
+		if(rc < 0) apps_running &= ~(1 << (bit));                  \
+	}
+	NODE_APPS(APP_MAIN)
+#undef APP_MAIN
+}
+
+#if defined(SYS_CAN_DCNCP) && defined(SYS_EEPROM) && defined(NODE_JOBS)
+static uint8_t l3_address_write(struct node_job *job)
+{
+	result_t rc;
+
+	rc = eeprom_write(EEPROM_NODE_L3_ADDRESS, l3_address);
+	RC_CHECK_PRINT_CONT("EEPROM Write\n\r");
+	return(NODE_JOB_DONE);
 }
+#endif
 
 void system_status_handler(status_source_t source, int16_t status, int16_t data)
 {
 	result_t rc  __attribute__((unused));
+#if defined(SYS_CAN_DCNCP) && defined(SYS_EEPROM) && defined(NODE_JOBS)
+	union sigval  job_data;
+#endif
 	
 	LOG_D("status_handler()\n\r");
-	switch(source) {
+	/*
+	 * APP_STATUS_SOURCE isn't one of libesoup's status_source_t values, so
+	 * switch on the source as an integer to keep the case well defined
+	 */
+	switch((uint16_t)source) {
 #ifdef SYS_CAN_BUS
 	case can_bus_l2_status:
 		switch(status) {
@@ -206,10 +464,11 @@ void system_status_handler(status_source_t source, int16_t status, int16_t data)
 		case can_l2_connected:
 			LOG_D("Connected - %s\n\r", can_baud_rate_strings[data]);
 			can_connected = TRUE;
+			NODE_TRACE_POINT(TRACE_CAN_CONNECTED, (uint8_t)data, 0);
 			if(app_valid) {
 				LOG_D("Call App Init as Application is valid\n\r");
-				rc = app_init(io_address, system_status_handler);
-				if(rc < 0) app_valid = FALSE;
+				NODE_TRACE_POINT(TRACE_APP_INIT, 0, 0);
+				apps_init();
 			} else {
 				LOG_E("App is not valid\n\r");
 			}
@@ -228,7 +487,12 @@ void system_status_handler(status_source_t source, int16_t status, int16_t data)
 			LOG_D("CAN L3 Address registered 0x%x\n\r", (uint8_t)data);
 			if (l3_address != (uint8_t)data) {
 				l3_address = (uint8_t)data;
+#if defined(SYS_EEPROM) && defined(NODE_JOBS)
+				job_data.sival_int = 0;
+				rc = node_job_submit(&l3_address_job, NODE_JOB_LOW, l3_address_write, job_data);
+#elif defined(SYS_EEPROM)
 				rc = eeprom_write(EEPROM_NODE_L3_ADDRESS, l3_address);
+#endif
 			}
 			break;
 		}
@@ -243,6 +507,19 @@ void system_status_handler(status_source_t source, int16_t status, int16_t data)
 	case iso11783_status:
 		break;
 #endif
+	case APP_STATUS_SOURCE:
+		switch(status) {
+		case app_input_quarantined:
+			LOG_W("Input node 0x%x quarantined\n\r", (uint8_t)data);
+			break;
+		case app_input_released:
+			LOG_I("Input node 0x%x released\n\r", (uint8_t)data);
+			break;
+		default:
+			LOG_E("App Status? %d\n\r", status);
+			break;
+		}
+		break;
 	default:
 		LOG_E("Status Src? %d\n\r", source);
 	}
@@ -0,0 +1,169 @@
+/**
+ * @file node_can.c
+ *
+ * @author John Whitmore
+ *
+ * @brief CAN Frame registration, dispatch and transmission for the CAN Node
+ *
+ * Copyright 2018 electronicSoup
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the version 3 of the GNU General Public License
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#include "libesoup_config.h"
+
+#ifdef SYS_CAN_BUS
+
+#ifdef SYS_SERIAL_LOGGING
+#define DEBUG_FILE
+static const char *TAG = "NodeCAN";
+#include "libesoup/logger/serial_log.h"
+#endif // SYS_SERIAL_LOGGING
+
+#include "libesoup/errno.h"
+#include "libesoup/comms/can/can.h"
+
+#include "node_ticks.h"
+#include "node_can.h"
+#include "node_stats.h"
+#include "node_time.h"
+#include "node_trace.h"
+#if defined(NODE_CAPTURE) || defined(NODE_REPLAY)
+#include "host/capture.h"
+#endif
+#ifdef NODE_SOCKETCAN
+#include "host/socketcan.h"
+#endif
+
+/*
+ * ES Control and the Node's own frames are all 11 bit identifiers so the
+ * table holds 16 bit filters and masks, rather than can_l2_target_t copies,
+ * which matters on the PIC18.
+ */
+struct handler {
+	uint16_t    filter;
+	uint16_t    mask;
+	void      (*handler)(can_frame *);
+};
+
+static struct handler   handlers[NODE_CAN_HANDLER_ARRAY_SIZE];
+static uint8_t          num_handlers = 0;
+
+result_t node_can_init(void)
+{
+#ifndef NODE_SOCKETCAN
+	can_l2_target_t  target;
+#endif
+
+	num_handlers = 0;
+
+#ifdef NODE_SOCKETCAN
+	/*
+	 * socketcan_tasks() calls node_can_rx_frame() directly
+	 */
+	return(0);
+#else
+	/*
+	 * Catch all handler, filtering is done against the Node's own table
+	 */
+	target.filter  = 0x00;
+	target.mask    = 0x00;
+	target.handler = node_can_rx_frame;
+	return(frame_dispatch_reg_handler(&target));
+#endif
+}
+
+result_t node_can_reg_handler(can_l2_target_t *target)
+{
+	if(num_handlers >= NODE_CAN_HANDLER_ARRAY_SIZE) {
+		LOG_E("Handler table full\n\r");
+		return(-ERR_NO_RESOURCES);
+	}
+
+	if((target->filter & ~CAN_SFF_MASK) || (target->mask & ~CAN_SFF_MASK)) {
+		LOG_E("Only 11 bit identifiers handled\n\r");
+		return(-ERR_BAD_INPUT_PARAMETER);
+	}
+
+	handlers[num_handlers].filter  = (uint16_t)target->filter;
+	handlers[num_handlers].mask    = (uint16_t)target->mask;
+	handlers[num_handlers].handler = target->handler;
+#ifdef NODE_SOCKETCAN
+	socketcan_filter(num_handlers, handlers[num_handlers].filter, handlers[num_handlers].mask);
+#endif
+
+	return(num_handlers++);
+}
+
+void node_can_rx_frame(can_frame *frame)
+{
+	uint8_t       loop;
+#ifdef NODE_STATS
+	node_ticks_t  start;
+#endif
+
+	NODE_TIME_RX_MARK();
+	NODE_STATS_INC(rx_frames);
+	NODE_TRACE_POINT(TRACE_RX_FRAME, frame->data[0], (uint16_t)frame->can_id);
+#ifdef NODE_CAPTURE
+	capture_frame(frame, 0);
+#endif
+
+	/*
+	 * Extended frames never match an 11 bit filter
+	 */
+	if(frame->can_id & CAN_EFF_FLAG) return;
+
+	for(loop = 0; loop < num_handlers; loop++) {
+		if(((uint16_t)frame->can_id & handlers[loop].mask) == (handlers[loop].filter & handlers[loop].mask)) {
+			NODE_TRACE_POINT(TRACE_HANDLER_BEGIN, loop, 0);
+#ifdef NODE_STATS
+			start = node_ticks();
+			handlers[loop].handler(frame);
+			node_stats_handler_time(node_ticks() - start);
+#else
+			handlers[loop].handler(frame);
+#endif
+			NODE_TRACE_POINT(TRACE_HANDLER_END, loop, 0);
+#ifdef NODE_REPLAY
+			capture_replay_handled(loop, handlers[loop].handler);
+#endif
+		}
+	}
+}
+
+result_t node_can_tx_frame(can_frame *frame)
+{
+	result_t rc;
+
+#if defined(NODE_REPLAY)
+	rc = capture_replay_tx(frame);
+#elif defined(NODE_SOCKETCAN)
+	rc = socketcan_tx_frame(frame);
+#else
+	rc = can_l2_tx_frame(frame);
+#endif
+	if(rc < 0) {
+		NODE_STATS_INC(tx_errors);
+		NODE_TRACE_POINT(TRACE_TX_ERROR, frame->data[0], (uint16_t)frame->can_id);
+	} else {
+		NODE_STATS_INC(tx_frames);
+		NODE_TRACE_POINT(TRACE_TX_FRAME, frame->data[0], (uint16_t)frame->can_id);
+#ifdef NODE_CAPTURE
+		capture_frame(frame, CAPTURE_FLAG_TX);
+#endif
+	}
+	return(rc);
+}
+
+#endif // SYS_CAN_BUS
@@ -0,0 +1,41 @@
+/**
+ * @file node_can.h
+ *
+ * @author John Whitmore
+ *
+ * @brief CAN Frame registration, dispatch and transmission for the CAN Node
+ *
+ * Copyright 2018 electronicSoup
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the version 3 of the GNU General Public License
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#ifndef _NODE_CAN_H
+#define _NODE_CAN_H
+
+#ifdef SYS_CAN_BUS
+/*
+ * The Node registers a single handler with the libesoup frame dispatcher
+ * and fans received frames out to the Node's own handlers, so that every
+ * frame in and out of the Node passes through one place for accounting.
+ *
+ * Applications use node_can_reg_handler() and node_can_tx_frame() in place
+ * of frame_dispatch_reg_handler() and can_l2_tx_frame().
+ */
+extern result_t node_can_init(void);
+extern result_t node_can_reg_handler(can_l2_target_t *target);
+extern result_t node_can_tx_frame(can_frame *frame);
+extern void     node_can_rx_frame(can_frame *frame);
+#endif // SYS_CAN_BUS
+
+#endif // _NODE_CAN_H
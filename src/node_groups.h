@@ -0,0 +1,57 @@
+/**
+ * @file node_groups.h
+ *
+ * @author John Whitmore
+ *
+ * @brief Output groups for the CAN Node
+ *
+ * Copyright 2018 electronicSoup
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the version 3 of the GNU General Public License
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#ifndef _NODE_GROUPS_H
+#define _NODE_GROUPS_H
+
+/*
+ * Switch Output channels are members of any of NODE_GROUPS_NUM groups, so
+ * one byte switches a group's outputs on every node at once, where
+ * bool_431 outputs take a byte per channel.
+ *
+ * ESC_GROUP_OUTPUT frames carry up to eight groups:
+ *
+ *   data[n]  group number in the low 7 bits, the value in the top bit
+ *
+ * ESC_GROUP_CONFIG frames set one node's channels in a group, and are
+ * answered, as an RTR with the first two bytes, with the node's mask:
+ *
+ *   data[0]  node address
+ *   data[1]  group number
+ *   data[2]  bitmask of the node's channels in the group
+ *
+ * An RTR with the node address alone is a node, as it starts, asking the
+ * primary Controller for all of its groups.
+ *
+ * Nodes keep their groups in EEPROM, if they have one, so the group
+ * table only has to be sent when it changes. The two types differ in
+ * bit 0 alone, so one handler table entry takes both.
+ */
+#define NODE_GROUP_VALUE        0x80
+#define NODE_GROUP_MASK         0x7f
+#define NODE_GROUP_NONE         0xff
+
+#define NODE_GROUP_TYPE_MASK    (ESC_TYPE_MASK & ~0x01)
+
+#define NODE_GROUP_BYTE(group, value)   ((uint8_t)((group) | ((value) ? NODE_GROUP_VALUE : 0)))
+
+#endif // _NODE_GROUPS_H
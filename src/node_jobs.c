@@ -0,0 +1,252 @@
+/**
+ * @file node_jobs.c
+ *
+ * @author John Whitmore
+ *
+ * @brief Cooperative jobs run from the CAN Node's main loop
+ *
+ * Copyright 2018 electronicSoup
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the version 3 of the GNU General Public License
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#include "libesoup_config.h"
+
+#ifdef NODE_JOBS
+
+#ifdef SYS_SERIAL_LOGGING
+#define DEBUG_FILE
+static const char *TAG = "Jobs";
+#include "libesoup/logger/serial_log.h"
+#endif // SYS_SERIAL_LOGGING
+
+#include "libesoup/errno.h"
+#include "libesoup/timers/sw_timers.h"
+
+#include "node_ticks.h"
+#include "node_jobs.h"
+
+#if defined(NODE_JOBS_BENCH) && !defined(__RPI)
+#error "Jobs bench is for host builds"
+#endif
+
+#define BUDGET_TICKS    ((node_ticks_t)(((uint32_t)NODE_JOBS_BUDGET_us * NODE_TICKS_PER_ms) / 1000))
+
+/*
+ * A FIFO of waiting jobs for each priority
+ */
+static struct node_job  *heads[NODE_JOB_PRIORITIES];
+static struct node_job  *tails[NODE_JOB_PRIORITIES];
+
+static node_ticks_t      pass_start;
+
+static void job_queue(struct node_job *job)
+{
+	job->next = NULL;
+	if(heads[job->priority]) {
+		tails[job->priority]->next = job;
+	} else {
+		heads[job->priority] = job;
+	}
+	tails[job->priority] = job;
+	job->queued = 1;
+}
+
+static struct node_job *job_next(void)
+{
+	uint8_t           priority;
+	struct node_job  *job;
+
+	for(priority = 0; priority < NODE_JOB_PRIORITIES; priority++) {
+		job = heads[priority];
+		if(job) {
+			heads[priority] = job->next;
+			job->queued = 0;
+			return(job);
+		}
+	}
+	return(NULL);
+}
+
+void node_jobs_init(void)
+{
+	uint8_t  priority;
+
+	for(priority = 0; priority < NODE_JOB_PRIORITIES; priority++) {
+		heads[priority] = NULL;
+		tails[priority] = NULL;
+	}
+}
+
+result_t node_job_submit(struct node_job *job, uint8_t priority, node_job_fn_t fn, union sigval data)
+{
+	if(priority >= NODE_JOB_PRIORITIES) return(-ERR_BAD_INPUT_PARAMETER);
+	if(job->queued) return(0);
+
+	job->fn       = fn;
+	job->data     = data;
+	job->step     = 0;
+	job->priority = priority;
+	job_queue(job);
+	return(0);
+}
+
+boolean node_jobs_waiting(void)
+{
+	uint8_t  priority;
+
+	for(priority = 0; priority < NODE_JOB_PRIORITIES; priority++) {
+		if(heads[priority]) return(TRUE);
+	}
+	return(FALSE);
+}
+
+boolean node_job_yield(void)
+{
+	return((node_ticks_t)(node_ticks() - pass_start) >= BUDGET_TICKS);
+}
+
+/*
+ * Runs job slices until the budget is spent or nothing is waiting. A job
+ * yielding goes to the back of its queue, unless it was submitted again
+ * during the slice and so is queued already, starting over from step 0.
+ */
+void node_jobs_tasks(void)
+{
+	struct node_job  *job;
+
+	pass_start = node_ticks();
+
+	do {
+		job = job_next();
+		if(!job) return;
+
+		if((job->fn(job) == NODE_JOB_YIELD) && !job->queued) {
+			job->step++;
+			job_queue(job);
+		}
+	} while(!node_job_yield());
+}
+
+#ifdef NODE_JOBS_BENCH
+/*
+ * Every 200mS a burst of 16 EEPROM writes of 5mS each and an output fan
+ * out of 256 outputs of 20uS each arrives. Without jobs the burst is done
+ * in the pass it arrives. Passes otherwise cost next to nothing, so the
+ * worst pass is the time a frame or the watchdog could be kept waiting.
+ */
+#define BENCH_RUN_ms           2000
+#define BENCH_PERIOD_ms         200
+#define BENCH_WRITES             16
+#define BENCH_WRITE_us         5000
+#define BENCH_OUTPUTS           256
+#define BENCH_OUTPUT_us          20
+
+static struct node_job  bench_writes;
+static struct node_job  bench_fanout;
+static uint16_t         bench_output;
+
+static void bench_spin(uint32_t us)
+{
+	node_ticks_t  start;
+
+	start = node_ticks();
+	while((node_ticks_t)(node_ticks() - start) < (node_ticks_t)((us * NODE_TICKS_PER_ms) / 1000));
+}
+
+/*
+ * A write can't be split, so one per slice
+ */
+static uint8_t bench_write_job(struct node_job *job)
+{
+	bench_spin(BENCH_WRITE_us);
+	return((job->step + 1 < BENCH_WRITES) ? NODE_JOB_YIELD : NODE_JOB_DONE);
+}
+
+static uint8_t bench_fanout_job(struct node_job *job)
+{
+	if(job->step == 0) bench_output = 0;
+
+	while(bench_output < BENCH_OUTPUTS) {
+		bench_spin(BENCH_OUTPUT_us);
+		bench_output++;
+		if(node_job_yield()) return(NODE_JOB_YIELD);
+	}
+	return(NODE_JOB_DONE);
+}
+
+static void bench_run(boolean jobs)
+{
+	uint16_t      loop;
+	uint32_t      passes = 0;
+	uint32_t      slow   = 0;
+	boolean       busy   = FALSE;
+	node_ticks_t  start;
+	node_ticks_t  next;
+	node_ticks_t  arrived = 0;
+	node_ticks_t  last;
+	node_ticks_t  now;
+	node_ticks_t  worst = 0;
+	node_ticks_t  done  = 0;
+	union sigval  data;
+
+	data.sival_int = 0;
+	start = node_ticks();
+	next  = start;
+	last  = start;
+
+	while((node_ticks_t)(last - start) < (node_ticks_t)(BENCH_RUN_ms * NODE_TICKS_PER_ms)) {
+		if((int32_t)(last - next) >= 0) {
+			next   += BENCH_PERIOD_ms * NODE_TICKS_PER_ms;
+			arrived = last;
+			busy    = TRUE;
+			if(jobs) {
+				node_job_submit(&bench_writes, NODE_JOB_LOW, bench_write_job, data);
+				node_job_submit(&bench_fanout, NODE_JOB_NORMAL, bench_fanout_job, data);
+			} else {
+				for(loop = 0; loop < BENCH_WRITES; loop++) bench_spin(BENCH_WRITE_us);
+				for(loop = 0; loop < BENCH_OUTPUTS; loop++) bench_spin(BENCH_OUTPUT_us);
+			}
+		}
+		if(jobs) node_jobs_tasks();
+
+		now = node_ticks();
+		if(busy && !NODE_JOB_QUEUED(&bench_writes) && !NODE_JOB_QUEUED(&bench_fanout)) {
+			if((node_ticks_t)(now - arrived) > done) done = now - arrived;
+			busy = FALSE;
+		}
+		if((node_ticks_t)(now - last) > worst) worst = now - last;
+		if((node_ticks_t)(now - last) > 2 * BUDGET_TICKS) slow++;
+		last = now;
+		passes++;
+	}
+	LOG_I("%s: worst pass %luus, %lu of %lu passes over %dus, burst done in %luus\n\r",
+	      jobs ? "Jobs  " : "Inline",
+	      (unsigned long)((worst * 1000) / NODE_TICKS_PER_ms),
+	      (unsigned long)slow, (unsigned long)passes, 2 * NODE_JOBS_BUDGET_us,
+	      (unsigned long)((done * 1000) / NODE_TICKS_PER_ms));
+}
+
+void node_jobs_bench(void)
+{
+	NODE_JOB_INIT(&bench_writes);
+	NODE_JOB_INIT(&bench_fanout);
+
+	LOG_I("Every %dms: %d writes of %dus, %d outputs of %dus, budget %dus\n\r",
+	      BENCH_PERIOD_ms, BENCH_WRITES, BENCH_WRITE_us, BENCH_OUTPUTS, BENCH_OUTPUT_us, NODE_JOBS_BUDGET_us);
+	bench_run(FALSE);
+	bench_run(TRUE);
+}
+#endif // NODE_JOBS_BENCH
+
+#endif // NODE_JOBS
@@ -0,0 +1,90 @@
+/**
+ * @file node_jobs.h
+ *
+ * @author John Whitmore
+ *
+ * @brief Cooperative jobs run from the CAN Node's main loop
+ *
+ * Copyright 2018 electronicSoup
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the version 3 of the GNU General Public License
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#ifndef _NODE_JOBS_H
+#define _NODE_JOBS_H
+
+#include "libesoup/timers/sw_timers.h"
+
+/*
+ * Work too long to do in one go, in a frame handler or a status handler,
+ * is handed to a job instead. Each pass of the main loop gives jobs up to
+ * NODE_JOBS_BUDGET_us, so frame reception and the watchdog are never held
+ * up for longer than that plus the longest single slice.
+ *
+ * A job function does a slice of the work and returns NODE_JOB_YIELD to
+ * be called again on a later pass, or NODE_JOB_DONE. job->step is the
+ * job's own, zeroed on submission, for picking up where it left off.
+ * Long loops within a slice check node_job_yield(), which is TRUE once
+ * the pass's budget is spent.
+ *
+ * The highest priority job ready runs first, jobs of equal priority take
+ * turns. Jobs are owned by the caller, as timer wheel timers are, and
+ * submitting a job already waiting leaves it as it is, so repeated
+ * requests for the same work collapse into one. A job submitted again
+ * while its slice is running, by itself or by a handler it calls, is
+ * queued afresh with step zeroed, whatever the slice returns. Jobs are
+ * submitted from main loop context only, not from interrupts.
+ */
+#define NODE_JOB_DONE      0
+#define NODE_JOB_YIELD     1
+
+enum node_job_priority {
+	NODE_JOB_HIGH = 0,
+	NODE_JOB_NORMAL,
+	NODE_JOB_LOW,
+	NODE_JOB_PRIORITIES
+};
+
+struct node_job;
+
+typedef uint8_t (*node_job_fn_t)(struct node_job *job);
+
+struct node_job {
+	struct node_job  *next;
+	node_job_fn_t     fn;
+	union sigval      data;
+	uint16_t          step;
+	uint8_t           priority;
+	uint8_t           queued;
+};
+
+#define NODE_JOB_INIT(job)      ((job)->queued = 0)
+#define NODE_JOB_QUEUED(job)    ((job)->queued)
+
+#ifdef NODE_JOBS
+extern void     node_jobs_init(void);
+extern void     node_jobs_tasks(void);
+extern result_t node_job_submit(struct node_job *job, uint8_t priority, node_job_fn_t fn, union sigval data);
+extern boolean  node_job_yield(void);
+extern boolean  node_jobs_waiting(void);
+
+#ifdef NODE_JOBS_BENCH
+/*
+ * Host builds only. Worst and average main loop pass with a synthetic
+ * load of EEPROM writes and output fan out, done inline and as jobs.
+ */
+extern void     node_jobs_bench(void);
+#endif
+#endif // NODE_JOBS
+
+#endif // _NODE_JOBS_H
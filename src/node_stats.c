@@ -0,0 +1,249 @@
+/**
+ * @file node_stats.c
+ *
+ * @author John Whitmore
+ *
+ * @brief Health and performance counters for the CAN Node
+ *
+ * Copyright 2018 electronicSoup
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the version 3 of the GNU General Public License
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#include "libesoup_config.h"
+
+#ifdef NODE_STATS
+
+#ifdef SYS_SERIAL_LOGGING
+#define DEBUG_FILE
+static const char *TAG = "Stats";
+#include "libesoup/logger/serial_log.h"
+#endif // SYS_SERIAL_LOGGING
+
+#include "libesoup/errno.h"
+#include "libesoup/timers/sw_timers.h"
+#ifdef SYS_CAN_BUS
+#include "libesoup/comms/can/can.h"
+#include "libesoup/comms/can/es_control/es_control.h"
+#endif
+#ifdef SYS_EEPROM
+#include "libesoup/hardware/eeprom.h"
+#endif
+
+#include "node_ticks.h"
+#include "node_can.h"
+#include "node_stats.h"
+#include "timer_wheel.h"
+
+struct node_stats node_stats;
+
+#ifdef TIMER_WHEEL
+static struct wheel_timer  second_timer;
+#endif
+
+#ifdef SYS_CAN_BUS
+static uint8_t    node_address;
+#endif
+static boolean    loop_started = FALSE;
+
+#ifdef TIMER_WHEEL
+static void second_expiry(struct wheel_timer *timer, union sigval data)
+#else
+static void second_expiry(timer_id timer, union sigval data)
+#endif
+{
+	node_stats.loops_per_second = node_stats.loops;
+	node_stats.loops            = 0;
+}
+
+/*
+ * Called at the top of every pass of the main loop. The longest pass is
+ * the longest a received frame or the watchdog has been kept waiting.
+ */
+void node_stats_loop(void)
+{
+	node_ticks_t  now;
+
+	now = node_ticks();
+	if(loop_started && ((node_ticks_t)(now - node_stats.loop_last) > node_stats.loop_max)) {
+		node_stats.loop_max = now - node_stats.loop_last;
+	}
+	node_stats.loop_last = now;
+	loop_started         = TRUE;
+	node_stats.loops++;
+}
+
+void node_stats_handler_time(node_ticks_t ticks)
+{
+	if(ticks < node_stats.handler_min) node_stats.handler_min = ticks;
+	if(ticks > node_stats.handler_max) node_stats.handler_max = ticks;
+
+	/*
+	 * Halve the running totals rather than let them overflow, which keeps
+	 * the average meaningful on a node that has been up for a long time
+	 */
+	if(node_stats.handler_count == 0xffff) {
+		node_stats.handler_count >>= 1;
+		node_stats.handler_total >>= 1;
+	}
+	node_stats.handler_count++;
+	node_stats.handler_total += ticks;
+}
+
+void node_stats_rx_ring_level(uint16_t level)
+{
+	if(level > node_stats.rx_high_water) node_stats.rx_high_water = level;
+}
+
+#ifdef SYS_CAN_BUS
+static uint16_t saturate(uint32_t value)
+{
+	return((value > 0xffff) ? 0xffff : (uint16_t)value);
+}
+
+static void put_page(can_frame *frame, uint8_t page)
+{
+	uint16_t  values[3];
+	uint8_t   loop;
+
+	values[2] = 0;
+
+	switch(page) {
+	case NODE_STATS_PAGE_FRAMES:
+		values[0] = node_stats.rx_frames;
+		values[1] = node_stats.tx_frames;
+		values[2] = node_stats.rx_dropped;
+		break;
+	case NODE_STATS_PAGE_HANDLERS:
+		values[0] = (node_stats.handler_count) ? saturate(node_stats.handler_min) : 0;
+		values[1] = saturate(node_stats.handler_max);
+		values[2] = (node_stats.handler_count) ? saturate(node_stats.handler_total / node_stats.handler_count) : 0;
+		break;
+	case NODE_STATS_PAGE_LOOP:
+		values[0] = saturate(node_stats.loops_per_second);
+		values[1] = node_stats.rx_high_water;
+		values[2] = node_stats.tx_errors;
+		break;
+	case NODE_STATS_PAGE_RESETS:
+		values[0] = node_stats.watchdog_resets;
+		values[1] = saturate(NODE_TICKS_PER_ms);
+		values[2] = saturate(((uint32_t)node_stats.loop_max / NODE_TICKS_PER_ms) * 1000
+		                     + (((uint32_t)node_stats.loop_max % NODE_TICKS_PER_ms) * 1000) / NODE_TICKS_PER_ms);
+		node_stats.loop_max = 0;
+		break;
+	}
+
+	frame->data[0] = node_address;
+	frame->data[1] = page;
+	for(loop = 0; loop < 3; loop++) {
+		frame->data[2 + (loop * 2)] = (uint8_t)(values[loop] & 0xff);
+		frame->data[3 + (loop * 2)] = (uint8_t)(values[loop] >> 8);
+	}
+	frame->can_dlc = 8;
+}
+
+static void node_stats_rtr(can_frame *rx_frame)
+{
+	result_t              rc;
+	uint8_t               page;
+	uint8_t               pages;
+	can_frame             tx_frame;
+	union es_control_id   es_id;
+
+	if((rx_frame->can_dlc < 1) || (rx_frame->data[0] != node_address)) return;
+
+	pages = (rx_frame->can_dlc > 1) ? rx_frame->data[1] : ((1 << NODE_STATS_NUM_PAGES) - 1);
+
+	es_id.word            = 0x0000;
+	es_id.fields.priority = ESC_PRIORITY_3;
+	es_id.fields.es_type  = ESC_NODE_STATS;
+	tx_frame.can_id       = es_id.word;
+
+	for(page = 0; page < NODE_STATS_NUM_PAGES; page++) {
+		if(pages & (1 << page)) {
+			put_page(&tx_frame, page);
+			rc = node_can_tx_frame(&tx_frame);
+			RC_CHECK_PRINT_VOID("Stats resp\n\r");
+		}
+	}
+}
+#endif // SYS_CAN_BUS
+
+result_t node_stats_init(uint8_t address, boolean watchdog)
+{
+	result_t          rc;
+#ifdef TIMER_WHEEL
+	union sigval      data;
+#else
+	struct timer_req  request;
+#endif
+#ifdef SYS_CAN_BUS
+	can_l2_target_t   target;
+#endif
+
+	node_stats.rx_frames        = 0;
+	node_stats.tx_frames        = 0;
+	node_stats.rx_dropped       = 0;
+	node_stats.tx_errors        = 0;
+	node_stats.rx_high_water    = 0;
+	node_stats.loops            = 0;
+	node_stats.loops_per_second = 0;
+	node_stats.loop_max         = 0;
+	node_stats.handler_min      = (node_ticks_t)~0;
+	node_stats.handler_max      = 0;
+	node_stats.handler_total    = 0;
+	node_stats.handler_count    = 0;
+
+	/*
+	 * The watchdog reset count survives a reset in EEPROM
+	 */
+#ifdef SYS_EEPROM
+	rc = eeprom_read(EEPROM_NODE_WDT_RESETS_ADDR);
+	node_stats.watchdog_resets = ((rc < 0) || (rc == 0xff)) ? 0 : (uint8_t)rc;
+	if(watchdog && (node_stats.watchdog_resets < 0xfe)) {
+		node_stats.watchdog_resets++;
+		rc = eeprom_write(EEPROM_NODE_WDT_RESETS_ADDR, (uint8_t)node_stats.watchdog_resets);
+		RC_CHECK_PRINT_CONT("EEPROM Write\n\r");
+	}
+#else
+	node_stats.watchdog_resets = (watchdog) ? 1 : 0;
+#endif
+
+#ifdef TIMER_WHEEL
+	data.sival_int = 0;
+	TIMER_WHEEL_INIT(&second_timer);
+	rc = timer_wheel_start(&second_timer, 1000, TRUE, second_expiry, data);
+	RC_CHECK
+#else
+	request.period.units    = Seconds;
+	request.period.duration = 1;
+	request.type            = repeat;
+	request.exp_fn          = second_expiry;
+	request.data.sival_int  = 0;
+	rc = sw_timer_start(&request);
+	RC_CHECK
+#endif
+
+#ifdef SYS_CAN_BUS
+	node_address = address;
+
+	target.filter  = ESC_RTR_MASK | ESC_NODE_STATS;
+	target.mask    = ESC_RTR_MASK | ESC_TYPE_MASK;
+	target.handler = node_stats_rtr;
+	rc = node_can_reg_handler(&target);
+	RC_CHECK
+#endif
+	return(0);
+}
+
+#endif // NODE_STATS
@@ -0,0 +1,85 @@
+/**
+ * @file node_stats.h
+ *
+ * @author John Whitmore
+ *
+ * @brief Health and performance counters for the CAN Node
+ *
+ * Copyright 2018 electronicSoup
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the version 3 of the GNU General Public License
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#ifndef _NODE_STATS_H
+#define _NODE_STATS_H
+
+#include "node_ticks.h"
+
+/*
+ * Counters are read with an ESC_NODE_STATS RTR frame:
+ *
+ *   data[0]  node address
+ *   data[1]  bitmask of pages requested, all pages if not present
+ *
+ * Each page is answered with an ESC_NODE_STATS frame carrying the node
+ * address, the page number and three 16 bit values, low byte first:
+ *
+ *   page 0   rx frames, tx frames, rx frames dropped
+ *   page 1   handler dispatch time min, max and average in node ticks
+ *   page 2   main loop iterations per second, rx ring high water, tx errors
+ *   page 3   watchdog resets, node ticks per mS, longest main loop pass in
+ *            uS since the page was last read
+ *
+ * Counters saturate rather than wrap. The L2 driver reports dropped frames
+ * with NODE_STATS_INC(rx_dropped) and its receive ring occupancy with
+ * node_stats_rx_ring_level().
+ */
+#define NODE_STATS_PAGE_FRAMES      0
+#define NODE_STATS_PAGE_HANDLERS    1
+#define NODE_STATS_PAGE_LOOP        2
+#define NODE_STATS_PAGE_RESETS      3
+#define NODE_STATS_NUM_PAGES        4
+
+#ifdef NODE_STATS
+struct node_stats {
+	uint16_t      rx_frames;
+	uint16_t      tx_frames;
+	uint16_t      rx_dropped;
+	uint16_t      tx_errors;
+	uint16_t      rx_high_water;
+	uint32_t      loops;
+	uint32_t      loops_per_second;
+	node_ticks_t  loop_last;
+	node_ticks_t  loop_max;
+	uint16_t      watchdog_resets;
+	node_ticks_t  handler_min;
+	node_ticks_t  handler_max;
+	uint32_t      handler_total;
+	uint16_t      handler_count;
+};
+
+extern struct node_stats node_stats;
+
+#define NODE_STATS_INC(counter)  do { if(node_stats.counter < 0xffff) node_stats.counter++; } while(0)
+#define NODE_STATS_LOOP()        node_stats_loop()
+
+extern result_t node_stats_init(uint8_t address, boolean watchdog);
+extern void     node_stats_loop(void);
+extern void     node_stats_handler_time(node_ticks_t ticks);
+extern void     node_stats_rx_ring_level(uint16_t level);
+#else
+#define NODE_STATS_INC(counter)
+#define NODE_STATS_LOOP()
+#endif // NODE_STATS
+
+#endif // _NODE_STATS_H
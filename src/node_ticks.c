@@ -0,0 +1,101 @@
+/**
+ * @file node_ticks.c
+ *
+ * @author John Whitmore
+ *
+ * @brief Free running hardware tick counter for the CAN Node
+ *
+ * Copyright 2018 electronicSoup
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the version 3 of the GNU General Public License
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#include "libesoup_config.h"
+
+#if defined(__RPI)
+#include <time.h>
+#endif
+
+#include "node_ticks.h"
+
+/*
+ * The timers used here are kept out of the libesoup hw_timers pool:
+ *
+ *   dsPIC33EP256MU806  Timer 8/9 as a 32 bit pair, 1:8 prescale
+ *   PIC24FJ256GB106    Timer 4/5 as a 32 bit pair, 1:8 prescale
+ *   PIC18F4585         Timer 3, 1:8 prescale
+ */
+void node_ticks_init(void)
+{
+#if defined(__dsPIC33EP256MU806__)
+	T8CON            = 0x0000;
+	T9CON            = 0x0000;
+	T8CONbits.T32    = 1;
+	T8CONbits.TCKPS  = 0b01;
+	TMR9HLD          = 0x0000;
+	TMR8             = 0x0000;
+	PR8              = 0xffff;
+	PR9              = 0xffff;
+	T8CONbits.TON    = 1;
+#elif defined(__PIC24FJ256GB106__)
+	T4CON            = 0x0000;
+	T5CON            = 0x0000;
+	T4CONbits.T32    = 1;
+	T4CONbits.TCKPS  = 0b01;
+	TMR5HLD          = 0x0000;
+	TMR4             = 0x0000;
+	PR4              = 0xffff;
+	PR5              = 0xffff;
+	T4CONbits.TON    = 1;
+#elif defined(__18F4585)
+	T3CON            = 0x00;
+	T3CONbits.RD16   = 1;
+	T3CONbits.T3CKPS = 0b11;
+	TMR3H            = 0x00;
+	TMR3L            = 0x00;
+	T3CONbits.TMR3ON = 1;
+#endif
+}
+
+node_ticks_t node_ticks(void)
+{
+#if defined(__dsPIC33EP256MU806__)
+	uint16_t lsw;
+
+	/*
+	 * Reading the lsw latches the msw into the holding register
+	 */
+	lsw = TMR8;
+	return(((uint32_t)TMR9HLD << 16) | lsw);
+#elif defined(__PIC24FJ256GB106__)
+	uint16_t lsw;
+
+	lsw = TMR4;
+	return(((uint32_t)TMR5HLD << 16) | lsw);
+#elif defined(__18F4585)
+	uint8_t  lsb;
+
+	/*
+	 * RD16 mode, reading TMR3L latches TMR3H
+	 */
+	lsb = TMR3L;
+	return(((uint16_t)TMR3H << 8) | lsb);
+#elif defined(__RPI)
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return((uint32_t)((now.tv_sec * 1000000UL) + (now.tv_nsec / 1000)));
+#else
+	return(0);
+#endif
+}
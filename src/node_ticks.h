@@ -0,0 +1,45 @@
+/**
+ * @file node_ticks.h
+ *
+ * @author John Whitmore
+ *
+ * @brief Free running hardware tick counter for the CAN Node
+ *
+ * Copyright 2018 electronicSoup
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the version 3 of the GNU General Public License
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#ifndef _NODE_TICKS_H
+#define _NODE_TICKS_H
+
+/*
+ * The 16 bit parts run a 32 bit timer pair, the PIC18 a single 16 bit timer
+ * as 32 bit arithmetic is expensive on the 8 bit core. Differences between
+ * two readings are only valid for one wrap of the counter.
+ */
+#if defined(__18F4585)
+typedef uint16_t node_ticks_t;
+#define NODE_TICKS_PER_ms    ((SYS_CLOCK_FREQ / 4) / 8 / 1000)
+#elif defined(__RPI)
+typedef uint32_t node_ticks_t;
+#define NODE_TICKS_PER_ms    1000
+#else
+typedef uint32_t node_ticks_t;
+#define NODE_TICKS_PER_ms    ((SYS_CLOCK_FREQ / 2) / 8 / 1000)
+#endif
+
+extern void         node_ticks_init(void);
+extern node_ticks_t node_ticks(void);
+
+#endif // _NODE_TICKS_H
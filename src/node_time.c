@@ -0,0 +1,441 @@
+/**
+ * @file node_time.c
+ *
+ * @author John Whitmore
+ *
+ * @brief Bus wide time for the CAN Node
+ *
+ * Copyright 2018 electronicSoup
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the version 3 of the GNU General Public License
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#include "libesoup_config.h"
+
+#ifdef NODE_TIME
+
+#ifdef SYS_SERIAL_LOGGING
+#define DEBUG_FILE
+static const char *TAG = "Time";
+#include "libesoup/logger/serial_log.h"
+#endif // SYS_SERIAL_LOGGING
+
+#include "libesoup/errno.h"
+#include "libesoup/timers/sw_timers.h"
+#include "libesoup/comms/can/can.h"
+#include "libesoup/comms/can/es_control/es_control.h"
+
+#ifdef NODE_TIME_BENCH
+#include <stdlib.h>
+#endif
+
+#include "node_ticks.h"
+#include "node_can.h"
+#include "node_time.h"
+#include "node_trace.h"
+#include "timer_wheel.h"
+
+#ifndef TIMER_WHEEL
+#error "Bus time syncs run on the timer wheel"
+#endif
+#if defined(NODE_TIME_BENCH) && !defined(__RPI)
+#error "Bus time bench is for host builds"
+#endif
+
+/*
+ * Each sync moves the clock a fraction of the error seen, in phase, and
+ * its rate by a smaller fraction of the error over the interval since the
+ * last sync. Receive latency jitter is averaged out over a few syncs
+ * rather than followed. An error beyond NODE_TIME_STEP_us, e.g. after a
+ * new master has taken over, is stepped and the rate learnt again.
+ */
+#define PHASE_GAIN      4
+#define FREQ_GAIN      16
+
+/*
+ * Rate is held in 1/16 ppm units, so the correction for elapsed mS is
+ * elapsed * rate / 16000 uS
+ */
+#define RATE_SCALE      16000
+
+struct node_clock {
+	uint32_t  base_net;       // Bus time at base_local
+	uint32_t  base_local;
+	uint32_t  last_sync;      // Local time of the last sync followed
+	int32_t   rate;           // Local clock error, 1/16 ppm, +ve if slow
+	uint8_t   syncs;          // Syncs followed since the last step
+};
+
+node_ticks_t               node_time_rx_ticks;
+
+static uint8_t             node_address;
+static boolean             master = FALSE;
+static uint8_t             sequence;
+static struct node_clock   bus_clock;
+static struct wheel_timer  sync_timer;
+
+/*
+ * Local time is the hardware tick counter in uS, extended to 32 bits. The
+ * PIC18's 16 bit counter wraps in tens of mS so node_time_tasks() keeps
+ * the extension up to date from the main loop.
+ */
+static uint32_t            local_us;
+static uint32_t            local_part;    // Ticks not yet counted in local_us
+static node_ticks_t        local_last;
+
+static uint32_t ticks_to_us(uint32_t ticks)
+{
+	return(((ticks / NODE_TICKS_PER_ms) * 1000) + (((ticks % NODE_TICKS_PER_ms) * 1000) / NODE_TICKS_PER_ms));
+}
+
+static uint32_t local_time(void)
+{
+	node_ticks_t  now;
+	uint32_t      ms;
+
+	now         = node_ticks();
+	local_part += (node_ticks_t)(now - local_last);
+	local_last  = now;
+
+	ms          = local_part / NODE_TICKS_PER_ms;
+	local_part -= ms * NODE_TICKS_PER_ms;
+	local_us   += ms * 1000;
+	return(local_us + ((local_part * 1000) / NODE_TICKS_PER_ms));
+}
+
+static uint32_t clock_net(struct node_clock *clk, uint32_t local)
+{
+	uint32_t  elapsed;
+
+	elapsed = local - clk->base_local;
+	return(clk->base_net + elapsed + (((int32_t)(elapsed / 1000) * clk->rate) / RATE_SCALE));
+}
+
+/*
+ * Keeps the elapsed time in clock_net() short enough not to overflow
+ */
+static void clock_anchor(struct node_clock *clk, uint32_t local)
+{
+	clk->base_net   = clock_net(clk, local);
+	clk->base_local = local;
+}
+
+/*
+ * Bus time was master at local time local, returns the error seen
+ */
+static int32_t clock_sync(struct node_clock *clk, uint32_t master_time, uint32_t local)
+{
+	uint32_t  predicted;
+	uint32_t  interval_ms;
+	int32_t   error;
+
+	predicted   = clock_net(clk, local);
+	error       = (int32_t)(master_time - predicted);
+	interval_ms = (local - clk->last_sync) / 1000;
+
+	clk->last_sync  = local;
+	clk->base_local = local;
+
+	if((clk->syncs == 0) || (error > NODE_TIME_STEP_us) || (error < -NODE_TIME_STEP_us)) {
+		clk->base_net = master_time;
+		clk->syncs    = 1;
+		return(error);
+	}
+
+	clk->base_net = predicted + (error / PHASE_GAIN);
+	if(interval_ms) {
+		clk->rate += ((error * RATE_SCALE) / (int32_t)interval_ms) / FREQ_GAIN;
+	}
+	if(clk->syncs < 0xff) clk->syncs++;
+	return(error);
+}
+
+static void sync_expiry(struct wheel_timer *timer, union sigval data);
+
+static void sync_timer_restart(void)
+{
+	union sigval  data;
+	uint32_t      duration;
+
+	data.sival_int = 0;
+	duration = NODE_TIME_SYNC_ms;
+	if(!master) duration *= NODE_TIME_MASTER_MISSED;
+	timer_wheel_start(&sync_timer, duration, FALSE, sync_expiry, data);
+}
+
+static void sync_send(void)
+{
+	result_t               rc;
+	uint32_t               now;
+	can_frame              frame;
+	union es_control_id    es_id;
+
+	clock_anchor(&bus_clock, local_time());
+	now = bus_clock.base_net;
+
+	es_id.word            = 0x0000;
+	es_id.fields.priority = ESC_PRIORITY_2;
+	es_id.fields.es_type  = ESC_NODE_TIME;
+	frame.can_id          = es_id.word;
+	frame.can_dlc         = 6;
+	frame.data[0]         = node_address;
+	frame.data[1]         = sequence++;
+	frame.data[2]         = (uint8_t)(now & 0xff);
+	frame.data[3]         = (uint8_t)((now >> 8) & 0xff);
+	frame.data[4]         = (uint8_t)((now >> 16) & 0xff);
+	frame.data[5]         = (uint8_t)((now >> 24) & 0xff);
+	rc = node_can_tx_frame(&frame);
+	RC_CHECK_PRINT_VOID("Sync\n\r");
+}
+
+/*
+ * Master: time for the next sync. Otherwise: no master heard
+ */
+static void sync_expiry(struct wheel_timer *timer, union sigval data)
+{
+	uint32_t  local;
+
+	if(!master) {
+		/*
+		 * Carry on from the bus time followed so far, if any
+		 */
+		local = local_time();
+		if(bus_clock.syncs == 0) {
+			bus_clock.base_net   = local;
+			bus_clock.base_local = local;
+		}
+		bus_clock.syncs = 0xff;
+		master          = TRUE;
+		LOG_I("Time master\n\r");
+	}
+	sync_send();
+	sync_timer_restart();
+}
+
+static void sync_rx(can_frame *frame)
+{
+	uint32_t  master_time;
+	uint32_t  local;
+	int32_t   error __attribute__((unused));
+
+	if((frame->can_dlc < 6) || (frame->data[0] == node_address)) return;
+
+	if(master) {
+		if(frame->data[0] > node_address) return;
+		master          = FALSE;
+		bus_clock.syncs = 0;
+		LOG_I("Time master 0x%x\n\r", frame->data[0]);
+	}
+#ifdef NODE_TIME_MASTER
+	sync_timer_restart();
+#endif
+
+	master_time = (uint32_t)frame->data[2]
+	            | ((uint32_t)frame->data[3] << 8)
+	            | ((uint32_t)frame->data[4] << 16)
+	            | ((uint32_t)frame->data[5] << 24);
+	master_time += NODE_TIME_RX_LATENCY_us;
+
+	/*
+	 * Back to the moment the frame arrived
+	 */
+	local = local_time();
+	local -= ticks_to_us((node_ticks_t)(node_ticks() - node_time_rx_ticks));
+
+	error = clock_sync(&bus_clock, master_time, local);
+	NODE_TRACE_POINT(TRACE_TIME_SYNC, frame->data[1],
+	                 (uint16_t)((error > 32767) ? 32767 : (error < -32768) ? -32768 : error));
+}
+
+uint32_t node_time_now(void)
+{
+	uint32_t  local;
+
+	local = local_time();
+	if((uint32_t)(local - bus_clock.base_local) > ((uint32_t)NODE_TIME_HOLDOVER_ms * 1000)) {
+		clock_anchor(&bus_clock, local);
+	}
+	return(clock_net(&bus_clock, local));
+}
+
+boolean node_time_synced(void)
+{
+	if(master) return(TRUE);
+	return((bus_clock.syncs >= 2) && ((local_time() - bus_clock.last_sync) < ((uint32_t)NODE_TIME_HOLDOVER_ms * 1000)));
+}
+
+void node_time_tasks(void)
+{
+	local_time();
+}
+
+result_t node_time_init(uint8_t address)
+{
+	result_t          rc;
+	can_l2_target_t   target;
+
+	node_address = address;
+	master       = FALSE;
+	local_last   = node_ticks();
+	local_part   = 0;
+	local_us     = 0;
+
+	bus_clock.base_net   = 0;
+	bus_clock.base_local = 0;
+	bus_clock.last_sync  = 0;
+	bus_clock.rate       = 0;
+	bus_clock.syncs      = 0;
+
+	TIMER_WHEEL_INIT(&sync_timer);
+#ifdef NODE_TIME_MASTER
+	/*
+	 * Listen for a master before becoming one
+	 */
+	sync_timer_restart();
+#endif
+
+	target.filter  = ESC_NODE_TIME;
+	target.mask    = ESC_RTR_MASK | ESC_TYPE_MASK;
+	target.handler = sync_rx;
+	rc = node_can_reg_handler(&target);
+	RC_CHECK
+	return(0);
+}
+
+#ifdef NODE_TIME_BENCH
+/*
+ * Times are true uS from the start of the bench. Each node's crystal is
+ * up to NODE_TIME_BENCH_PPM out and its main loop takes up to the jitter
+ * being tried to dispatch a frame or notice an output falling due. The
+ * master's sync waits behind up to one frame already on the bus.
+ */
+#define BENCH_SYNCS          120
+#define BENCH_SETTLE         20
+#define BENCH_SYNC_FRAME_us  420       // 6 bytes at 250kbit/s
+#define BENCH_OUT_FRAME_us   490       // 8 bytes at 250kbit/s
+#define BENCH_LEAD_us        20000
+
+static struct node_clock   bench_clocks[NODE_TIME_BENCH_NODES];
+static double              bench_rate[NODE_TIME_BENCH_NODES];
+static double              bench_offset[NODE_TIME_BENCH_NODES];
+
+static double bench_random(double max)
+{
+	return(max * (double)rand() / (double)RAND_MAX);
+}
+
+static uint32_t bench_local(uint8_t node, double t)
+{
+	return((uint32_t)(uint64_t)(bench_offset[node] + (t * bench_rate[node])));
+}
+
+static int32_t bench_error(uint8_t node, double t)
+{
+	return((int32_t)(clock_net(&bench_clocks[node], bench_local(node, t)) - (uint32_t)(uint64_t)t));
+}
+
+static void bench_run(uint32_t jitter)
+{
+	uint8_t   node;
+	uint16_t  sync;
+	uint32_t  samples = 0;
+	double    t;
+	double    arrival;
+	double    first;
+	double    last;
+	double    err_sum = 0;
+	int32_t   err_max = 0;
+	int32_t   error;
+	double    timed_sum = 0;
+	double    timed_max = 0;
+	double    plain_sum = 0;
+	double    plain_max = 0;
+
+	for(node = 0; node < NODE_TIME_BENCH_NODES; node++) {
+		bench_rate[node]   = 1.0 + ((bench_random(2.0 * NODE_TIME_BENCH_PPM) - NODE_TIME_BENCH_PPM) / 1000000.0);
+		bench_offset[node] = bench_random(4000000000.0);
+		bench_clocks[node].base_net   = 0;
+		bench_clocks[node].base_local = 0;
+		bench_clocks[node].last_sync  = 0;
+		bench_clocks[node].rate       = 0;
+		bench_clocks[node].syncs      = 0;
+	}
+
+	for(sync = 0; sync < BENCH_SYNCS; sync++) {
+		t = (double)sync * NODE_TIME_SYNC_ms * 1000.0;
+		arrival = t + bench_random(BENCH_OUT_FRAME_us) + BENCH_SYNC_FRAME_us;
+		for(node = 0; node < NODE_TIME_BENCH_NODES; node++) {
+			clock_sync(&bench_clocks[node], (uint32_t)(uint64_t)t + NODE_TIME_RX_LATENCY_us,
+			           bench_local(node, arrival + bench_random(jitter)));
+		}
+		if(sync < BENCH_SETTLE) continue;
+
+		/*
+		 * Bus time error somewhere before the next sync
+		 */
+		t += bench_random(NODE_TIME_SYNC_ms * 1000.0);
+		for(node = 0; node < NODE_TIME_BENCH_NODES; node++) {
+			error = bench_error(node, t);
+			if(error < 0) error = -error;
+			err_sum += error;
+			if(error > err_max) err_max = error;
+			samples++;
+		}
+
+		/*
+		 * A scene switching 8 outputs on every node. Timed, each node
+		 * switches when its bus time reaches the time given. Otherwise
+		 * each node's frame of 8 follows the one before on the bus.
+		 */
+		first = 1e18;
+		last  = 0;
+		for(node = 0; node < NODE_TIME_BENCH_NODES; node++) {
+			arrival = t + BENCH_LEAD_us - bench_error(node, t + BENCH_LEAD_us) + bench_random(jitter);
+			if(arrival < first) first = arrival;
+			if(arrival > last)  last  = arrival;
+		}
+		timed_sum += last - first;
+		if(last - first > timed_max) timed_max = last - first;
+
+		first = 1e18;
+		last  = 0;
+		for(node = 0; node < NODE_TIME_BENCH_NODES; node++) {
+			arrival = t + ((node + 1) * BENCH_OUT_FRAME_us) + bench_random(jitter);
+			if(arrival < first) first = arrival;
+			if(arrival > last)  last  = arrival;
+		}
+		plain_sum += last - first;
+		if(last - first > plain_max) plain_max = last - first;
+	}
+
+	sync = BENCH_SYNCS - BENCH_SETTLE;
+	LOG_I("jitter %5luus: error avg %5luus max %5luus, skew timed avg %5luus max %5luus, untimed avg %5luus max %5luus\n\r",
+	      (unsigned long)jitter, (unsigned long)(err_sum / samples), (unsigned long)err_max,
+	      (unsigned long)(timed_sum / sync), (unsigned long)timed_max,
+	      (unsigned long)(plain_sum / sync), (unsigned long)plain_max);
+}
+
+void node_time_bench(void)
+{
+	static const uint32_t  jitters[] = { 0, 50, 200, 1000 };
+	uint8_t                loop;
+
+	srand(1);
+	LOG_I("%d nodes, +/-%dppm, sync every %dms\n\r", NODE_TIME_BENCH_NODES, NODE_TIME_BENCH_PPM, NODE_TIME_SYNC_ms);
+	for(loop = 0; loop < sizeof(jitters) / sizeof(jitters[0]); loop++) {
+		bench_run(jitters[loop]);
+	}
+}
+#endif // NODE_TIME_BENCH
+
+#endif // NODE_TIME
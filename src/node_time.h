@@ -0,0 +1,83 @@
+/**
+ * @file node_time.h
+ *
+ * @author John Whitmore
+ *
+ * @brief Bus wide time for the CAN Node
+ *
+ * Copyright 2018 electronicSoup
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the version 3 of the GNU General Public License
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#ifndef _NODE_TIME_H
+#define _NODE_TIME_H
+
+#include "node_ticks.h"
+
+/*
+ * Bus time is a 32 bit count of microseconds, wrapping every 71 minutes,
+ * so times are compared with NODE_TIME_DUE() rather than directly.
+ *
+ * A time master sends an ESC_NODE_TIME frame every NODE_TIME_SYNC_ms:
+ *
+ *   data[0]  master's node address
+ *   data[1]  sequence number
+ *   data[2]  bus time the frame was queued, 4 bytes low byte first
+ *
+ * Every other node notes its own hardware time as the frame arrives and
+ * steers a local clock, offset and rate, towards the master's. Nodes
+ * built with NODE_TIME_MASTER listen first and only become master if no
+ * sync is heard for NODE_TIME_MASTER_MISSED periods. A master hearing
+ * another with a lower address stands down.
+ *
+ * A node is synchronised once it has followed two syncs and stays so for
+ * NODE_TIME_HOLDOVER_ms after the last one. A master always is.
+ *
+ * ESC_TIMED_OUTPUT frames carry a bus time followed by up to four
+ * bool_431 outputs to be set at that time:
+ *
+ *   data[0]  bus time, 4 bytes low byte first
+ *   data[4]  bool_431 outputs
+ */
+#define NODE_TIME_DUE(at, now)    ((int32_t)((uint32_t)(now) - (uint32_t)(at)) >= 0)
+
+#define NODE_TIME_OUTPUT_OFFSET   4
+
+#ifdef NODE_TIME
+/*
+ * node_can notes the hardware time a frame reached the Node, before any
+ * handler has run, with NODE_TIME_RX_MARK()
+ */
+extern node_ticks_t node_time_rx_ticks;
+
+#define NODE_TIME_RX_MARK()       (node_time_rx_ticks = node_ticks())
+
+extern result_t node_time_init(uint8_t address);
+extern void     node_time_tasks(void);
+extern uint32_t node_time_now(void);
+extern boolean  node_time_synced(void);
+
+#ifdef NODE_TIME_BENCH
+/*
+ * Host builds only. Simulates NODE_TIME_BENCH_NODES nodes following a
+ * master, each with its own crystal error and receive latency, and logs
+ * their bus time error and the spread of a timed output across them.
+ */
+extern void     node_time_bench(void);
+#endif
+#else
+#define NODE_TIME_RX_MARK()
+#endif // NODE_TIME
+
+#endif // _NODE_TIME_H
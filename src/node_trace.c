@@ -0,0 +1,189 @@
+/**
+ * @file node_trace.c
+ *
+ * @author John Whitmore
+ *
+ * @brief Compile time trace points for the CAN Node
+ *
+ * Copyright 2018 electronicSoup
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the version 3 of the GNU General Public License
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#include "libesoup_config.h"
+
+#ifdef NODE_TRACE
+
+#include "libesoup/errno.h"
+#ifdef SYS_CAN_BUS
+#include "libesoup/comms/can/can.h"
+#include "libesoup/comms/can/es_control/es_control.h"
+#endif
+
+#include "node_ticks.h"
+#include "node_can.h"
+#include "node_trace.h"
+
+struct trace_record {
+	node_ticks_t  ticks;
+	uint16_t      arg16;
+	uint8_t       event;
+	uint8_t       arg8;
+};
+
+/*
+ * Ring of the most recent records, the oldest is overwritten
+ */
+static struct trace_record  records[NODE_TRACE_BUFFER_SIZE];
+static uint16_t             head;
+static uint16_t             count;
+static boolean              paused;
+
+#ifdef SYS_CAN_BUS
+static uint8_t              node_address;
+
+enum dump_state {
+	dump_idle,
+	dump_header,
+	dump_records,
+	dump_trailer,
+};
+
+static enum dump_state      dump;
+static uint16_t             dump_index;
+#endif
+
+/*
+ * Called from main loop context only
+ */
+void node_trace(uint8_t event, uint8_t arg8, uint16_t arg16)
+{
+	if(paused) return;
+
+	records[head].ticks = node_ticks();
+	records[head].event = event;
+	records[head].arg8  = arg8;
+	records[head].arg16 = arg16;
+
+	head = (head + 1) % NODE_TRACE_BUFFER_SIZE;
+	if(count < NODE_TRACE_BUFFER_SIZE) count++;
+}
+
+#ifdef SYS_CAN_BUS
+static void node_trace_rtr(can_frame *rx_frame)
+{
+	if((rx_frame->can_dlc < 1) || (rx_frame->data[0] != node_address)) return;
+
+	if(dump == dump_idle) {
+		paused     = TRUE;
+		dump       = dump_header;
+		dump_index = 0;
+	}
+}
+
+static void put_uint32(uint8_t *data, uint32_t value)
+{
+	data[0] = (uint8_t)(value & 0xff);
+	data[1] = (uint8_t)((value >> 8) & 0xff);
+	data[2] = (uint8_t)((value >> 16) & 0xff);
+	data[3] = (uint8_t)((value >> 24) & 0xff);
+}
+#endif // SYS_CAN_BUS
+
+/*
+ * Sends at most one frame of a buffer read out per call, so a read out
+ * never holds up the main loop or floods the transmit queue.
+ */
+void node_trace_tasks(void)
+{
+#ifdef SYS_CAN_BUS
+	can_frame             frame;
+	union es_control_id   es_id;
+	struct trace_record  *record;
+
+	if(dump == dump_idle) return;
+
+	es_id.word            = 0x0000;
+	es_id.fields.priority = ESC_PRIORITY_3;
+	es_id.fields.es_type  = ESC_NODE_TRACE;
+	frame.can_id          = es_id.word;
+	frame.can_dlc         = 8;
+
+	switch(dump) {
+	case dump_header:
+		frame.data[0] = NODE_TRACE_HEADER;
+		frame.data[1] = node_address;
+		frame.data[2] = (uint8_t)(count & 0xff);
+		frame.data[3] = (uint8_t)(count >> 8);
+		put_uint32(&frame.data[4], (uint32_t)node_ticks());
+		break;
+	case dump_records:
+		record = &records[(head + NODE_TRACE_BUFFER_SIZE - count + dump_index) % NODE_TRACE_BUFFER_SIZE];
+		frame.data[0] = node_address;
+		frame.data[1] = record->event;
+		frame.data[2] = record->arg8;
+		frame.data[3] = (uint8_t)(record->arg16 & 0xff);
+		frame.data[4] = (uint8_t)(record->arg16 >> 8);
+		frame.data[5] = (uint8_t)(record->ticks & 0xff);
+		frame.data[6] = (uint8_t)((record->ticks >> 8) & 0xff);
+		frame.data[7] = (uint8_t)(((uint32_t)record->ticks >> 16) & 0xff);
+		break;
+	case dump_trailer:
+		frame.data[0] = NODE_TRACE_TRAILER;
+		frame.data[1] = node_address;
+		put_uint32(&frame.data[2], NODE_TICKS_PER_ms);
+		frame.data[6] = (sizeof(node_ticks_t) == 2) ? 16 : 24;
+		frame.data[7] = 0x00;
+		break;
+	default:
+		return;
+	}
+
+	/*
+	 * Transmit errors are retried on the next pass of the main loop
+	 */
+	if(node_can_tx_frame(&frame) < 0) return;
+
+	switch(dump) {
+	case dump_header:
+		dump = (count) ? dump_records : dump_trailer;
+		break;
+	case dump_records:
+		if(++dump_index >= count) dump = dump_trailer;
+		break;
+	default:
+		dump   = dump_idle;
+		paused = FALSE;
+		break;
+	}
+#endif // SYS_CAN_BUS
+}
+
+result_t node_trace_init(uint8_t address)
+{
+#ifdef SYS_CAN_BUS
+	can_l2_target_t  target;
+
+	node_address = address;
+	dump         = dump_idle;
+
+	target.filter  = ESC_RTR_MASK | ESC_NODE_TRACE;
+	target.mask    = ESC_RTR_MASK | ESC_TYPE_MASK;
+	target.handler = node_trace_rtr;
+	return(node_can_reg_handler(&target));
+#else
+	return(0);
+#endif
+}
+
+#endif // NODE_TRACE
@@ -0,0 +1,88 @@
+/**
+ * @file node_trace.h
+ *
+ * @author John Whitmore
+ *
+ * @brief Compile time trace points for the CAN Node
+ *
+ * Copyright 2018 electronicSoup
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the version 3 of the GNU General Public License
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#ifndef _NODE_TRACE_H
+#define _NODE_TRACE_H
+
+/*
+ * Trace point events. Events with a _BEGIN / _END pair are shown as
+ * durations by the host tool, the rest as instants. The frame events carry
+ * the 11 bit CAN ID and first data byte so the host tool can match a frame
+ * transmitted by one node with its reception on another.
+ *
+ * Keep in step with EVENTS in tools/node_trace.py
+ */
+enum node_trace_event {
+	TRACE_BOOT = 0x00,
+	TRACE_CAN_CONNECTED,
+	TRACE_APP_INIT,
+	TRACE_APP_MAIN_BEGIN,
+	TRACE_APP_MAIN_END,
+	TRACE_RX_FRAME,           // arg8 data[0], arg16 CAN ID
+	TRACE_HANDLER_BEGIN,      // arg8 handler index
+	TRACE_HANDLER_END,        // arg8 handler index
+	TRACE_TX_FRAME,           // arg8 data[0], arg16 CAN ID
+	TRACE_TX_ERROR,           // arg8 data[0], arg16 CAN ID
+	TRACE_SWI_EDGE,           // arg8 bool_431 reported
+	TRACE_CTRL_INPUT,         // arg8 bool_431 received
+	TRACE_SWO_GPIO,           // arg8 bool_431 applied
+	TRACE_CTRL_ROLE,          // arg8 new Controller role
+	TRACE_TIME_SYNC,          // arg8 sync sequence, arg16 bus time error uS
+	TRACE_CTRL_QUARANTINE,    // arg8 input node, arg16 1 quarantined, 0 released
+	TRACE_USER = 0x40,        // Application defined from here on
+};
+
+/*
+ * Trace buffers are read with an ESC_NODE_TRACE RTR frame, data[0] being
+ * the node address. The node answers, paced from the main loop, with:
+ *
+ *   header   0xff, node, count (2 bytes), ticks now (4 bytes)
+ *   record   node, event, arg8, arg16 (2 bytes), ticks low 24 bits (3 bytes)
+ *   trailer  0xfe, node, ticks per mS (4 bytes), record tick bits, 0
+ *
+ * oldest record first. Multi byte values are low byte first. Tracing is
+ * paused while the buffer is being read out.
+ */
+#define NODE_TRACE_HEADER     0xff
+#define NODE_TRACE_TRAILER    0xfe
+
+#ifdef NODE_TRACE
+#define NODE_TRACE_POINT(event, arg8, arg16)   node_trace((event), (arg8), (arg16))
+
+extern result_t node_trace_init(uint8_t address);
+extern void     node_trace(uint8_t event, uint8_t arg8, uint16_t arg16);
+extern void     node_trace_tasks(void);
+#else
+#define NODE_TRACE_POINT(event, arg8, arg16)
+#endif // NODE_TRACE
+
+/*
+ * Trace points executed on every pass of the main loop fill the buffer in
+ * no time so have their own switch
+ */
+#if defined(NODE_TRACE) && defined(NODE_TRACE_MAIN_LOOP)
+#define NODE_TRACE_LOOP_POINT(event)           node_trace((event), 0, 0)
+#else
+#define NODE_TRACE_LOOP_POINT(event)
+#endif
+
+#endif // _NODE_TRACE_H
@@ -0,0 +1,369 @@
+/**
+ * @file timer_wheel.c
+ *
+ * @author John Whitmore
+ *
+ * @brief Hierarchical timer wheel for the CAN Node
+ *
+ * Copyright 2018 electronicSoup
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the version 3 of the GNU General Public License
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#include "libesoup_config.h"
+
+#ifdef TIMER_WHEEL
+
+#ifdef SYS_SERIAL_LOGGING
+#define DEBUG_FILE
+static const char *TAG = "Wheel";
+#include "libesoup/logger/serial_log.h"
+#endif // SYS_SERIAL_LOGGING
+
+#include "libesoup/errno.h"
+#include "libesoup/timers/sw_timers.h"
+
+#include "node_ticks.h"
+#include "timer_wheel.h"
+
+#define SLOTS             (1 << TIMER_WHEEL_SLOT_BITS)
+#define SLOT_MASK         (SLOTS - 1)
+#define BITMAP_WORDS      ((SLOTS + 15) / 16)
+#define LEVEL_SHIFT(l)    ((l) * TIMER_WHEEL_SLOT_BITS)
+#define NODE_TICKS_PER_WHEEL_TICK  ((uint32_t)NODE_TICKS_PER_ms * TIMER_WHEEL_TICK_ms)
+
+/*
+ * Level 0 slots hold timers due in the next SLOTS ticks, one slot per tick.
+ * Each higher level slot covers a whole rotation of the level below and is
+ * cascaded down when the level below wraps. Timers further out than the
+ * top level covers wait in its furthest slot and are cascaded again.
+ */
+static struct wheel_timer  *slots[TIMER_WHEEL_LEVELS][SLOTS];
+static uint16_t             occupied[TIMER_WHEEL_LEVELS][BITMAP_WORDS];
+static struct wheel_timer  *expiring;
+
+static uint32_t             now;
+static node_ticks_t         last_ticks;
+static uint32_t             pending_ticks;
+#ifdef TIMER_WHEEL_TICKLESS
+static uint32_t             next_event;
+#endif
+
+static void insert(struct wheel_timer *timer)
+{
+	uint32_t              delta;
+	uint8_t               level;
+	uint16_t              slot;
+	struct wheel_timer  **head;
+
+	delta = timer->expiry - now;
+
+	for(level = 0; level < TIMER_WHEEL_LEVELS - 1; level++) {
+		if(delta < ((uint32_t)SLOTS << LEVEL_SHIFT(level))) break;
+	}
+
+	if(delta < ((uint32_t)SLOTS << LEVEL_SHIFT(level))) {
+		slot = (timer->expiry >> LEVEL_SHIFT(level)) & SLOT_MASK;
+	} else {
+		slot = ((now >> LEVEL_SHIFT(level)) + SLOT_MASK) & SLOT_MASK;
+	}
+
+	head = &slots[level][slot];
+	timer->next  = *head;
+	timer->pprev = head;
+	if(*head) (*head)->pprev = &timer->next;
+	*head = timer;
+	occupied[level][slot >> 4] |= (1 << (slot & 0x0f));
+
+#ifdef TIMER_WHEEL_TICKLESS
+	if((level == 0) && ((timer->expiry - now) < (next_event - now))) {
+		next_event = timer->expiry;
+	}
+#endif
+}
+
+static void unlink(struct wheel_timer *timer)
+{
+	struct wheel_timer  **pprev;
+	uint16_t              index;
+
+	pprev = timer->pprev;
+	*pprev = timer->next;
+	if(timer->next) timer->next->pprev = pprev;
+	timer->pprev = NULL;
+
+	/*
+	 * Last timer out of a wheel slot clears its occupied bit
+	 */
+	if((*pprev == NULL) && (pprev >= &slots[0][0]) && (pprev < &slots[0][0] + (TIMER_WHEEL_LEVELS * SLOTS))) {
+		index = pprev - &slots[0][0];
+		occupied[index / SLOTS][(index & SLOT_MASK) >> 4] &= ~(1 << (index & 0x0f));
+	}
+}
+
+/*
+ * Detaches a slot's list onto the expiring list, so that timers re-inserted
+ * into the same slot by their expiry function are not seen again
+ */
+static void detach(uint8_t level, uint16_t slot)
+{
+	expiring = slots[level][slot];
+	if(expiring) expiring->pprev = &expiring;
+	slots[level][slot] = NULL;
+	occupied[level][slot >> 4] &= ~(1 << (slot & 0x0f));
+}
+
+static void cascade(uint8_t level)
+{
+	struct wheel_timer *timer;
+
+	detach(level, (now >> LEVEL_SHIFT(level)) & SLOT_MASK);
+	while((timer = expiring) != NULL) {
+		unlink(timer);
+		insert(timer);
+	}
+}
+
+static void expire(void)
+{
+	uint8_t              level;
+	struct wheel_timer  *timer;
+
+	if((now & SLOT_MASK) == 0) {
+		for(level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+			cascade(level);
+			if((now >> LEVEL_SHIFT(level)) & SLOT_MASK) break;
+		}
+	}
+
+	detach(0, now & SLOT_MASK);
+	while((timer = expiring) != NULL) {
+		unlink(timer);
+		if(timer->period) {
+			timer->expiry += timer->period;
+			insert(timer);
+		}
+		timer->exp_fn(timer, timer->data);
+	}
+}
+
+#ifdef TIMER_WHEEL_TICKLESS
+/*
+ * Next tick on which a level 0 slot is due or the wheel wraps
+ */
+static uint32_t find_next_event(void)
+{
+	uint16_t  slot;
+	uint16_t  bits;
+
+	for(slot = (now & SLOT_MASK) + 1; slot < SLOTS; slot = (slot + 16) & ~0x0f) {
+		bits = occupied[0][slot >> 4] >> (slot & 0x0f);
+		if(bits) {
+			while(!(bits & 0x01)) {
+				bits >>= 1;
+				slot++;
+			}
+			return((now & ~(uint32_t)SLOT_MASK) + slot);
+		}
+	}
+	return((now & ~(uint32_t)SLOT_MASK) + SLOTS);
+}
+#endif // TIMER_WHEEL_TICKLESS
+
+void timer_wheel_init(void)
+{
+	uint8_t   level;
+	uint16_t  slot;
+
+	for(level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+		for(slot = 0; slot < SLOTS; slot++) {
+			slots[level][slot] = NULL;
+		}
+		for(slot = 0; slot < BITMAP_WORDS; slot++) {
+			occupied[level][slot] = 0;
+		}
+	}
+	now           = 0;
+	pending_ticks = 0;
+	last_ticks    = node_ticks();
+#ifdef TIMER_WHEEL_TICKLESS
+	next_event    = SLOTS;
+#endif
+}
+
+/*
+ * Node ticks since the wheel's own time. That only moves on when
+ * timer_wheel_tasks() steps it, which tickless only does on an event, so
+ * can be behind by up to a rotation
+ */
+static uint32_t behind(void)
+{
+	return(pending_ticks + (node_ticks_t)(node_ticks() - last_ticks));
+}
+
+uint32_t timer_wheel_now(void)
+{
+	return(now + (behind() / NODE_TICKS_PER_WHEEL_TICK));
+}
+
+/*
+ * TRUE if timer_wheel_tasks() has work waiting, so the main loop mustn't
+ * sleep
+ */
+boolean timer_wheel_due(void)
+{
+#ifdef TIMER_WHEEL_TICKLESS
+	return(behind() >= (next_event - now) * NODE_TICKS_PER_WHEEL_TICK);
+#else
+	return(behind() >= NODE_TICKS_PER_WHEEL_TICK);
+#endif
+}
+
+void timer_wheel_tasks(void)
+{
+	node_ticks_t  ticks;
+	uint32_t      target;
+
+	ticks          = node_ticks();
+	pending_ticks += (node_ticks_t)(ticks - last_ticks);
+	last_ticks     = ticks;
+
+#ifdef TIMER_WHEEL_TICKLESS
+	if(pending_ticks < (next_event - now) * NODE_TICKS_PER_WHEEL_TICK) return;
+
+	target         = now + (pending_ticks / NODE_TICKS_PER_WHEEL_TICK);
+	pending_ticks %= NODE_TICKS_PER_WHEEL_TICK;
+
+	while((target - now) >= (next_event - now)) {
+		now = next_event;
+		expire();
+		next_event = find_next_event();
+	}
+	now = target;
+#else
+	if(pending_ticks < NODE_TICKS_PER_WHEEL_TICK) return;
+
+	target         = now + (pending_ticks / NODE_TICKS_PER_WHEEL_TICK);
+	pending_ticks %= NODE_TICKS_PER_WHEEL_TICK;
+
+	while(now != target) {
+		now++;
+		expire();
+	}
+#endif
+}
+
+result_t timer_wheel_start(struct wheel_timer *timer, uint32_t duration_ms, boolean repeat, wheel_expiry_t exp_fn, union sigval data)
+{
+	uint32_t  ticks;
+	uint32_t  elapsed;
+
+	if(!exp_fn) return(-ERR_BAD_INPUT_PARAMETER);
+
+	if(TIMER_WHEEL_ACTIVE(timer)) unlink(timer);
+
+	/*
+	 * Round up, a timer never expires early, and always at least one tick
+	 */
+	ticks = (duration_ms + TIMER_WHEEL_TICK_ms - 1) / TIMER_WHEEL_TICK_ms;
+	if(ticks == 0) ticks = 1;
+
+	/*
+	 * From the current time, not the wheel's, and a tick already under
+	 * way doesn't count towards the duration
+	 */
+	elapsed = behind();
+	timer->expiry = now + ((elapsed + NODE_TICKS_PER_WHEEL_TICK - 1) / NODE_TICKS_PER_WHEEL_TICK) + ticks;
+	timer->period = (repeat) ? ticks : 0;
+	timer->exp_fn = exp_fn;
+	timer->data   = data;
+	insert(timer);
+
+	return(0);
+}
+
+void timer_wheel_cancel(struct wheel_timer *timer)
+{
+	if(TIMER_WHEEL_ACTIVE(timer)) unlink(timer);
+}
+
+#ifdef TIMER_WHEEL_BENCH
+/*
+ * Cost of servicing the wheel per tick against the number of active timers,
+ * with a plain array scan, as the sw_timers module does, for comparison.
+ * Moves the wheel on so run it at boot before any other timer is started.
+ */
+#define BENCH_TICKS    1000
+
+static struct wheel_timer  bench_timers[TIMER_WHEEL_BENCH_TIMERS];
+static uint32_t            bench_remaining[TIMER_WHEEL_BENCH_TIMERS];
+static uint16_t            bench_expired;
+
+static void bench_expiry(struct wheel_timer *timer, union sigval data)
+{
+	bench_expired++;
+}
+
+void timer_wheel_bench(void)
+{
+	uint16_t      active;
+	uint16_t      loop;
+	uint16_t      tick;
+	uint32_t      seed = 1;
+	node_ticks_t  start;
+	node_ticks_t  wheel_cost;
+	node_ticks_t  scan_cost;
+	union sigval  data;
+
+	data.sival_int = 0;
+
+	for(active = 0; active <= TIMER_WHEEL_BENCH_TIMERS; active = (active) ? active * 2 : 1) {
+		bench_expired = 0;
+		for(loop = 0; loop < active; loop++) {
+			seed = (seed * 1103515245) + 12345;
+			TIMER_WHEEL_INIT(&bench_timers[loop]);
+			timer_wheel_start(&bench_timers[loop], ((seed >> 16) % 2000) + 5, TRUE, bench_expiry, data);
+			bench_remaining[loop] = bench_timers[loop].period;
+		}
+
+		start = node_ticks();
+		for(tick = 0; tick < BENCH_TICKS; tick++) {
+			now++;
+			expire();
+		}
+		wheel_cost = node_ticks() - start;
+
+		start = node_ticks();
+		for(tick = 0; tick < BENCH_TICKS; tick++) {
+			for(loop = 0; loop < active; loop++) {
+				if(--bench_remaining[loop] == 0) {
+					bench_remaining[loop] = bench_timers[loop].period;
+					bench_expiry(&bench_timers[loop], data);
+				}
+			}
+		}
+		scan_cost = node_ticks() - start;
+
+		for(loop = 0; loop < active; loop++) {
+			timer_wheel_cancel(&bench_timers[loop]);
+		}
+		LOG_I("%d timers: wheel %lu scan %lu ticks/1000 ticks, %d expiries\n\r",
+		      active, (unsigned long)wheel_cost, (unsigned long)scan_cost, bench_expired);
+	}
+#ifdef TIMER_WHEEL_TICKLESS
+	next_event = find_next_event();
+#endif
+}
+#endif // TIMER_WHEEL_BENCH
+
+#endif // TIMER_WHEEL
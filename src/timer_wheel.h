@@ -0,0 +1,68 @@
+/**
+ * @file timer_wheel.h
+ *
+ * @author John Whitmore
+ *
+ * @brief Hierarchical timer wheel for the CAN Node
+ *
+ * Copyright 2018 electronicSoup
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the version 3 of the GNU General Public License
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#ifndef _TIMER_WHEEL_H
+#define _TIMER_WHEEL_H
+
+#include "libesoup/timers/sw_timers.h"
+
+/*
+ * Timers are owned by the caller, so the number of timers is limited only
+ * by RAM, and starting or cancelling one is a list insert or unlink. The
+ * wheel is advanced from the main loop against node_ticks(), in steps of
+ * TIMER_WHEEL_TICK_ms.
+ *
+ * With TIMER_WHEEL_TICKLESS defined the wheel is not stepped through every
+ * tick. The main loop pass is a single comparison against the next expiry
+ * and the wheel then jumps straight to the next occupied slot.
+ *
+ * Expiry functions are called from main loop context and may start or
+ * cancel any timer, including the one expiring.
+ */
+struct wheel_timer;
+
+typedef void (*wheel_expiry_t)(struct wheel_timer *timer, union sigval data);
+
+struct wheel_timer {
+	struct wheel_timer  *next;
+	struct wheel_timer **pprev;
+	uint32_t             expiry;
+	uint32_t             period;
+	wheel_expiry_t       exp_fn;
+	union sigval         data;
+};
+
+#define TIMER_WHEEL_INIT(timer)    ((timer)->pprev = NULL)
+#define TIMER_WHEEL_ACTIVE(timer)  ((timer)->pprev != NULL)
+
+extern void     timer_wheel_init(void);
+extern void     timer_wheel_tasks(void);
+extern result_t timer_wheel_start(struct wheel_timer *timer, uint32_t duration_ms, boolean repeat, wheel_expiry_t exp_fn, union sigval data);
+extern void     timer_wheel_cancel(struct wheel_timer *timer);
+extern uint32_t timer_wheel_now(void);
+extern boolean  timer_wheel_due(void);
+
+#ifdef TIMER_WHEEL_BENCH
+extern void     timer_wheel_bench(void);
+#endif
+
+#endif // _TIMER_WHEEL_H
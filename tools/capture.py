@@ -0,0 +1,174 @@
+#!/usr/bin/env python3
+#
+# @file tools/capture.py
+#
+# @author John Whitmore
+#
+# @brief Convert between CAN Node capture files and candump logs
+#
+# Copyright 2018 electronicSoup
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the version 3 of the GNU General Public License
+# as published by the Free Software Foundation
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, see <http://www.gnu.org/licenses/>.
+#
+"""
+Capture files (see src/host/capture.h) are written by a host build of the
+Node with NODE_CAPTURE defined and replayed by one with NODE_REPLAY. This
+converts a `candump -L` log, e.g. from a real bus, into a capture file to
+replay, converts a capture back into a candump log for the can-utils, and
+dumps a capture as text.
+
+    candump -L can0 > bus.log
+    tools/capture.py from-candump bus.log bus.ecap
+    NODE_REPLAY_FILE=bus.ecap NODE_REPLAY_SPEED=0 ./can-node
+    tools/capture.py dump bus.ecap
+"""
+import argparse
+import re
+import struct
+import sys
+
+CAPTURE_MAGIC = 0x50414345
+CAPTURE_VERSION = 1
+CAPTURE_FLAG_TX = 0x01
+
+HEADER = struct.Struct('<IHHII')
+RECORD = struct.Struct('<IIBB2x8s')
+
+CAN_EFF_FLAG = 0x80000000
+CAN_RTR_FLAG = 0x40000000
+CAN_ERR_FLAG = 0x20000000
+
+CANDUMP_L = re.compile(r'^\(\s*([\d.]+)\)\s+(\S+)\s+([0-9A-Fa-f]+)#(R\d?|[0-9A-Fa-f]*)')
+
+
+def read_capture(path):
+    with open(path, 'rb') as capture:
+        data = capture.read()
+    if len(data) < HEADER.size:
+        sys.exit("%s: too short for a capture" % path)
+    magic, version, record_size, start_lo, start_hi = HEADER.unpack_from(data)
+    if magic != CAPTURE_MAGIC or version != CAPTURE_VERSION or record_size != RECORD.size:
+        sys.exit("%s: not a version %d capture" % (path, CAPTURE_VERSION))
+    start_us = (start_hi << 32) | start_lo
+
+    # Record timestamps are 32 bit and wrap, unwrap them on the way out
+    elapsed = 0
+    last = None
+    for offset in range(HEADER.size, len(data) - RECORD.size + 1, RECORD.size):
+        timestamp, can_id, dlc, flags, payload = RECORD.unpack_from(data, offset)
+        if last is None:
+            elapsed = timestamp
+        else:
+            elapsed += (timestamp - last) & 0xffffffff
+        last = timestamp
+        yield start_us + elapsed, can_id, dlc, flags, payload[:min(dlc, 8)]
+
+
+def write_capture(path, start_us, records):
+    with open(path, 'wb') as capture:
+        capture.write(HEADER.pack(CAPTURE_MAGIC, CAPTURE_VERSION, RECORD.size,
+                                  start_us & 0xffffffff, start_us >> 32))
+        for time_us, can_id, dlc, flags, payload in records:
+            capture.write(RECORD.pack((time_us - start_us) & 0xffffffff,
+                                      can_id, dlc, flags, payload))
+
+
+def from_candump(args):
+    records = []
+    with open(args.log) as log:
+        for line in log:
+            match = CANDUMP_L.match(line)
+            if not match:
+                continue
+            time_us = int(round(float(match.group(1)) * 1000000))
+            ident = match.group(3)
+            can_id = int(ident, 16)
+            if len(ident) > 3:
+                can_id |= CAN_EFF_FLAG
+            if match.group(4).startswith('R'):
+                can_id |= CAN_RTR_FLAG
+                dlc = int(match.group(4)[1:] or 0)
+                payload = b''
+            else:
+                payload = bytes.fromhex(match.group(4))
+                dlc = len(payload)
+            flags = CAPTURE_FLAG_TX if args.tx and match.group(2) == args.tx else 0
+            records.append((time_us, can_id, dlc, flags, payload))
+    if not records:
+        sys.exit("%s: no candump -L frames found" % args.log)
+    write_capture(args.capture, records[0][0], records)
+    print("%d frames" % len(records))
+
+
+def candump_line(time_us, interface, can_id, dlc, payload):
+    if can_id & CAN_EFF_FLAG:
+        ident = "%08X" % (can_id & 0x1fffffff)
+    else:
+        ident = "%03X" % (can_id & 0x7ff)
+    if can_id & CAN_RTR_FLAG:
+        body = "R%d" % dlc if dlc else "R"
+    else:
+        body = payload.hex().upper()
+    return "(%d.%06d) %s %s#%s" % (time_us // 1000000, time_us % 1000000, interface, ident, body)
+
+
+def to_candump(args):
+    out = open(args.log, 'w') if args.log else sys.stdout
+    for time_us, can_id, dlc, flags, payload in read_capture(args.capture):
+        interface = args.tx if (flags & CAPTURE_FLAG_TX) else args.interface
+        out.write(candump_line(time_us, interface, can_id, dlc, payload) + "\n")
+
+
+def dump(args):
+    first = None
+    count = 0
+    for time_us, can_id, dlc, flags, payload in read_capture(args.capture):
+        if first is None:
+            first = time_us
+        count += 1
+        print("%12.6f %s %s" % ((time_us - first) / 1000000.0,
+                                "TX" if flags & CAPTURE_FLAG_TX else "RX",
+                                candump_line(time_us, "", can_id, dlc, payload).split(" ", 2)[2]))
+    print("%d frames" % count)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    commands = parser.add_subparsers(dest='command')
+    commands.required = True
+
+    command = commands.add_parser('from-candump', help="candump -L log to capture")
+    command.add_argument('log')
+    command.add_argument('capture')
+    command.add_argument('--tx', metavar='INTERFACE',
+                         help="frames logged on this interface are marked as transmitted")
+    command.set_defaults(func=from_candump)
+
+    command = commands.add_parser('to-candump', help="capture to candump -L log")
+    command.add_argument('capture')
+    command.add_argument('log', nargs='?')
+    command.add_argument('--interface', default='can0')
+    command.add_argument('--tx', default='node', metavar='INTERFACE',
+                         help="interface name given to transmitted frames")
+    command.set_defaults(func=to_candump)
+
+    command = commands.add_parser('dump', help="print a capture")
+    command.add_argument('capture')
+    command.set_defaults(func=dump)
+
+    args = parser.parse_args()
+    args.func(args)
+
+
+if __name__ == '__main__':
+    main()
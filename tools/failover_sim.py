@@ -0,0 +1,192 @@
+#!/usr/bin/env python3
+#
+# @file tools/failover_sim.py
+#
+# @author John Whitmore
+#
+# @brief Simulated bus traffic for measuring Controller hot standby failover
+#
+# Copyright 2018 electronicSoup
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the version 3 of the GNU General Public License
+# as published by the Free Software Foundation
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, see <http://www.gnu.org/licenses/>.
+#
+"""
+Generates the bus a standby Controller sees (see CONTROLLER_HOT_STANDBY in
+src/application/Controller/controller.c): switch input nodes changing at
+random, a primary Controller answering each input with an output frame and
+sending heartbeats when idle and every few periods when busy, and the
+primary going silent part way through. The capture is replayed into a host build of the standby with
+NODE_REPLAY, which captures what the standby sends, and `analyse` reports
+the failover time and the heartbeat share of bus traffic.
+
+    tools/failover_sim.py generate --nodes 8 bus.ecap
+    NODE_REPLAY_FILE=bus.ecap NODE_REPLAY_OUTPUT=standby.ecap ./can-node
+    tools/failover_sim.py analyse bus.ecap standby.ecap
+
+`sweep` prints the heartbeat overhead against the number of input nodes
+from the generated traffic alone.
+"""
+import argparse
+import os
+import random
+import sys
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+import capture  # noqa: E402
+
+ESC_BOOL_431_INPUT = 0x11
+ESC_BOOL_431_OUTPUT = 0x10
+ESC_CONTROLLER_HEARTBEAT = 0x7c
+ESC_TIMED_OUTPUT = 0x7a
+ESC_GROUP_OUTPUT = 0x79
+
+# Frames only a primary sends
+PRIMARY_TYPES = (ESC_BOOL_431_OUTPUT, ESC_CONTROLLER_HEARTBEAT, ESC_TIMED_OUTPUT, ESC_GROUP_OUTPUT)
+ESC_PRIORITY_3 = 3
+
+HEARTBEAT_ID = (ESC_PRIORITY_3 << 8) | ESC_CONTROLLER_HEARTBEAT
+PRIMARY_ADDRESS = 0x01
+
+
+def bool_431(node, chan, value):
+    return ((node & 0x0f) << 4) | ((chan & 0x07) << 1) | (value & 0x01)
+
+
+def generate_frames(args):
+    """Frames as (time_us, can_id, payload) in time order"""
+    rng = random.Random(args.seed)
+    end_us = int(args.duration * 1000000)
+    fail_us = int(args.fail_at * 1000000)
+    heartbeat_us = args.heartbeat_ms * 1000
+
+    inputs = []
+    for node in range(args.nodes):
+        time_us = 0
+        state = 0
+        while True:
+            time_us += int(rng.expovariate(args.rate) * 1000000)
+            if time_us >= end_us:
+                break
+            state ^= 1
+            inputs.append((time_us, node, state))
+
+    frames = []
+    sent = []
+    for time_us, node, value in sorted(inputs):
+        frames.append((time_us, ESC_BOOL_431_INPUT, bytes([bool_431(node + 2, 0, value)])))
+        if time_us < fail_us:
+            sent.append(time_us + 1000)
+            frames.append((time_us + 1000, ESC_BOOL_431_OUTPUT, bytes([bool_431(node + 2, 1, value)])))
+
+    # Primary heartbeats at the end of each period it sent no outputs in,
+    # and every --heartbeat-busy periods regardless
+    period = 0
+    age = 0
+    index = 0
+    while (period + 1) * heartbeat_us <= min(end_us, fail_us):
+        period += 1
+        busy = False
+        while index < len(sent) and sent[index] < period * heartbeat_us:
+            busy = True
+            index += 1
+        age += 1
+        if not busy or age >= args.heartbeat_busy:
+            age = 0
+            frames.append((period * heartbeat_us, HEARTBEAT_ID, bytes([PRIMARY_ADDRESS, 1])))
+    frames.sort()
+    return frames, fail_us
+
+
+def load(frames, fail_us):
+    before = [f for f in frames if f[0] < fail_us]
+    heartbeats = sum(1 for f in before if f[1] == HEARTBEAT_ID)
+    return heartbeats, len(before)
+
+
+def generate(args):
+    frames, fail_us = generate_frames(args)
+    records = [(t, can_id, len(data), 0, data) for t, can_id, data in frames]
+    capture.write_capture(args.capture, 0, records)
+    heartbeats, total = load(frames, fail_us)
+    print("%d frames, primary silent at %.3fs, %d heartbeats (%.1f%% of traffic)"
+          % (len(frames), args.fail_at, heartbeats, 100.0 * heartbeats / max(total, 1)))
+
+
+def analyse(args):
+    bus = list(capture.read_capture(args.bus))
+    primary = [t for t, can_id, dlc, flags, data in bus
+               if (can_id & 0x7f) in (ESC_BOOL_431_OUTPUT, ESC_CONTROLLER_HEARTBEAT)]
+    if not primary:
+        sys.exit("%s: no primary traffic" % args.bus)
+    # Anything else the standby sends, e.g. group config, says nothing
+    # about when it took over
+    standby = [t for t, can_id, dlc, flags, data in capture.read_capture(args.standby)
+               if (can_id & 0xff) in PRIMARY_TYPES]
+    if not standby:
+        sys.exit("%s: standby sent no outputs or heartbeats, no failover" % args.standby)
+
+    # The replay plays the bus from its first frame, when the standby's
+    # capture starts, so times relative to those line up
+    last_primary = max(primary) - bus[0][0]
+    takeover = standby[0] - capture_start(args.standby)
+    print("primary last heard at %.3fs, standby took over %.3fs later"
+          % (last_primary / 1000000.0, (takeover - last_primary) / 1000000.0))
+
+
+def capture_start(path):
+    with open(path, 'rb') as stream:
+        magic, version, size, lo, hi = capture.HEADER.unpack(stream.read(capture.HEADER.size))
+    return (hi << 32) | lo
+
+
+def sweep(args):
+    print("%6s %10s %10s %8s" % ("nodes", "frames/s", "heartbt/s", "share"))
+    for nodes in (1, 2, 4, 8, 16, 32, 64):
+        args.nodes = nodes
+        frames, fail_us = generate_frames(args)
+        heartbeats, total = load(frames, fail_us)
+        seconds = fail_us / 1000000.0
+        print("%6d %10.1f %10.2f %7.1f%%" % (nodes, total / seconds, heartbeats / seconds,
+                                            100.0 * heartbeats / max(total, 1)))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    parser.add_argument('--nodes', type=int, default=8, help="switch input nodes")
+    parser.add_argument('--rate', type=float, default=0.5, help="input changes per node per second")
+    parser.add_argument('--duration', type=float, default=60.0, help="seconds of traffic")
+    parser.add_argument('--fail-at', type=float, default=30.0, help="primary goes silent, seconds")
+    parser.add_argument('--heartbeat-ms', type=int, default=500, help="CONTROLLER_HEARTBEAT_ms")
+    parser.add_argument('--heartbeat-busy', type=int, default=2, help="CONTROLLER_HEARTBEAT_BUSY")
+    parser.add_argument('--seed', type=int, default=1)
+    commands = parser.add_subparsers(dest='command')
+    commands.required = True
+
+    command = commands.add_parser('generate', help="write the bus seen by the standby")
+    command.add_argument('capture')
+    command.set_defaults(func=generate)
+
+    command = commands.add_parser('analyse', help="failover time from a replay's output")
+    command.add_argument('bus')
+    command.add_argument('standby')
+    command.set_defaults(func=analyse)
+
+    command = commands.add_parser('sweep', help="heartbeat overhead against node count")
+    command.set_defaults(func=sweep)
+
+    args = parser.parse_args()
+    args.func(args)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,164 @@
+#!/usr/bin/env python3
+#
+# @file tools/mem_budget.py
+#
+# @author John Whitmore
+#
+# @brief Per module RAM and Flash budget from a linker map file
+#
+# Copyright 2018 electronicSoup
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the version 3 of the GNU General Public License
+# as published by the Free Software Foundation
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, see <http://www.gnu.org/licenses/>.
+#
+"""
+Reports the RAM and Flash used by each object file of a build from its
+linker map file. XC16 and gcc (GNU ld) maps, and XC8 maps for the PIC18,
+are understood. The device, and so its RAM and Flash size, is taken from
+the configuration's targetDevice in nbproject/configurations.xml.
+
+Run by the Makefile after each build; by hand:
+
+    tools/mem_budget.py --conf Controller dist/Controller/production/*.map
+"""
+import argparse
+import os
+import re
+import sys
+
+# RAM bytes, Flash bytes
+DEVICES = {
+    "dsPIC33EP256MU806": (28 * 1024, 256 * 1024),
+    "PIC24FJ256GB106":   (16 * 1024, 256 * 1024),
+    "PIC18F4585":        (3328,      48 * 1024),
+}
+
+FLASH_SECTIONS = (".text", ".const", ".rodata", ".isr", ".init", ".fini", ".prog", ".eh_frame")
+RAM_SECTIONS = (".bss", ".nbss", ".pbss", ".sbss", ".data", ".ndata", ".sdata", ".xbss", ".ybss", "COMMON")
+
+GNU_FULL = re.compile(r'^ (\S+)\s+0x([0-9a-fA-F]+)\s+0x([0-9a-fA-F]+)\s+(\S+\.o(?:bj)?)\s*$')
+GNU_NAME = re.compile(r'^ (\S+)\s*$')
+GNU_REST = re.compile(r'^\s+0x([0-9a-fA-F]+)\s+0x([0-9a-fA-F]+)\s+(\S+\.o(?:bj)?)\s*$')
+
+XC8_MODULE = re.compile(r'^(\S+\.(?:p1|obj|o))\s+(\S+)?(.*)$')
+XC8_PSECT = re.compile(r'^\s+(\S+)\s+([0-9A-Fa-f]+)\s+([0-9A-Fa-f]+)\s+([0-9A-Fa-f]+)\s+([0-9A-Fa-f]+)\s+(\d+)')
+
+
+def section_class(name):
+    if name.startswith(RAM_SECTIONS):
+        return "ram"
+    if name.startswith(FLASH_SECTIONS) or name.endswith("_const"):
+        return "flash"
+    return None
+
+
+def parse_gnu(lines, pc_units):
+    modules = {}
+    pending = None
+    for line in lines:
+        section = size = obj = None
+        match = GNU_FULL.match(line)
+        if match:
+            section, size, obj = match.group(1), int(match.group(3), 16), match.group(4)
+        elif pending:
+            match = GNU_REST.match(line)
+            if match:
+                section, size, obj = pending, int(match.group(2), 16), match.group(3)
+        pending = None
+        if section is None:
+            match = GNU_NAME.match(line)
+            if match:
+                pending = match.group(1)
+            continue
+        kind = section_class(section)
+        if kind is None or size == 0:
+            continue
+        if kind == "flash" and pc_units:
+            # XC16 program memory lengths are in PC units, 2 per 24 bit word
+            size = (size * 3) // 2
+        entry = modules.setdefault(os.path.basename(obj), {"ram": 0, "flash": 0})
+        entry[kind] += size
+    return modules
+
+
+def parse_xc8(lines):
+    modules = {}
+    module = None
+    for line in lines:
+        match = XC8_MODULE.match(line)
+        if match:
+            module = os.path.basename(match.group(1))
+            # psect may follow the module name on the same line
+            line = " " + (match.group(2) or "") + match.group(3)
+        if module is None:
+            continue
+        match = XC8_PSECT.match(line)
+        if not match:
+            continue
+        size, space = int(match.group(4), 16), int(match.group(6))
+        kind = {0: "flash", 1: "ram"}.get(space)
+        if kind is None or size == 0:
+            continue
+        entry = modules.setdefault(module, {"ram": 0, "flash": 0})
+        entry[kind] += size
+    return modules
+
+
+def target_device(conf):
+    path = os.path.join(os.path.dirname(__file__), "..", "nbproject", "configurations.xml")
+    try:
+        text = open(path).read()
+    except OSError:
+        return None
+    match = re.search(r'<conf name="%s".*?<targetDevice>([^<]+)</targetDevice>' % re.escape(conf),
+                      text, re.S)
+    return match.group(1) if match else None
+
+
+def report(conf, device, modules, out):
+    ram_total = sum(m["ram"] for m in modules.values())
+    flash_total = sum(m["flash"] for m in modules.values())
+    out.write("\nMemory budget: %s (%s)\n" % (conf or "-", device or "unknown device"))
+    out.write("  %-32s %8s %8s\n" % ("module", "RAM", "Flash"))
+    for name, sizes in sorted(modules.items(), key=lambda m: (-m[1]["ram"], m[0])):
+        out.write("  %-32s %8d %8d\n" % (name, sizes["ram"], sizes["flash"]))
+    out.write("  %-32s %8d %8d\n" % ("total", ram_total, flash_total))
+    if device in DEVICES:
+        ram, flash = DEVICES[device]
+        out.write("  %-32s %7d%% %7d%%\n" % ("of " + device, (ram_total * 100) // ram,
+                                             (flash_total * 100) // flash))
+        return ram_total <= ram and flash_total <= flash
+    return True
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    parser.add_argument("maps", nargs="+", help="linker map files")
+    parser.add_argument("--conf", help="MPLAB-X configuration name")
+    parser.add_argument("--device", help="device, default from the configuration")
+    args = parser.parse_args()
+
+    fits = True
+    for path in args.maps:
+        lines = open(path, errors="replace").read().splitlines()
+        text = "\n".join(lines[:200])
+        device = args.device or (target_device(args.conf) if args.conf else None)
+        if "Machine type is" in text or "Selector" in text:
+            modules = parse_xc8(lines)
+        else:
+            modules = parse_gnu(lines, pc_units="Program Memory" in "\n".join(lines))
+        fits = report(args.conf, device, modules, sys.stdout) and fits
+    sys.exit(0 if fits else 1)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,248 @@
+#!/usr/bin/env python3
+#
+# @file tools/node_trace.py
+#
+# @author John Whitmore
+#
+# @brief Merge CAN Node trace buffers into a Chrome trace / Perfetto timeline
+#
+# Copyright 2018 electronicSoup
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the version 3 of the GNU General Public License
+# as published by the Free Software Foundation
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, see <http://www.gnu.org/licenses/>.
+#
+"""
+Reads the ESC_NODE_TRACE read out frames (see src/node_trace.h) from one or
+more candump logs, either `candump -L` or the default candump format, and
+writes a Chrome trace JSON file which chrome://tracing and ui.perfetto.dev
+load.
+
+Each node has its own free running clock. A frame traced as transmitted by
+one node and as received by another gives a correlation point between the
+two clocks; the offset between every pair of nodes is estimated from the
+smallest observed transmit to receive difference in each direction, and
+nodes are placed on the clock of the first node read.
+
+    candump -L can0 > trace.log
+    cansend can0 0FE#01          (ESC_NODE_TRACE RTR for node 0x01)
+    cansend can0 0FE#02
+    tools/node_trace.py trace.log -o trace.json
+"""
+import argparse
+import json
+import re
+import sys
+
+ESC_TYPE_MASK = 0x7f
+ESC_RTR_MASK = 0x80
+ESC_NODE_TRACE = 0x7e
+
+TRACE_HEADER = 0xff
+TRACE_TRAILER = 0xfe
+
+# Keep in step with enum node_trace_event in src/node_trace.h
+EVENTS = {
+    0x00: ("boot", "i"),
+    0x01: ("can connected", "i"),
+    0x02: ("app_init", "i"),
+    0x03: ("app_main", "B"),
+    0x04: ("app_main", "E"),
+    0x05: ("rx frame", "i"),
+    0x06: ("handler", "B"),
+    0x07: ("handler", "E"),
+    0x08: ("tx frame", "i"),
+    0x09: ("tx error", "i"),
+    0x0a: ("sw_input edge", "i"),
+    0x0b: ("controller input", "i"),
+    0x0c: ("sw_output gpio", "i"),
+    0x0d: ("controller role", "i"),
+    0x0e: ("time sync", "i"),
+    0x0f: ("input quarantine", "i"),
+}
+TRACE_RX_FRAME = 0x05
+TRACE_TX_FRAME = 0x08
+
+CANDUMP_L = re.compile(r'^\(\s*[\d.]+\)\s+\S+\s+([0-9A-Fa-f]+)#([0-9A-Fa-f]*)')
+CANDUMP = re.compile(r'^\s*\S+\s+([0-9A-Fa-f]+)\s+\[(\d)\]\s*((?:[0-9A-Fa-f]{2}\s*)*)')
+
+
+def frames(path):
+    with open(path) as log:
+        for line in log:
+            match = CANDUMP_L.match(line)
+            if match:
+                yield int(match.group(1), 16), bytes.fromhex(match.group(2))
+                continue
+            match = CANDUMP.match(line)
+            if match:
+                yield int(match.group(1), 16), bytes.fromhex(match.group(3))
+
+
+class Dump:
+    """One buffer read out from one node"""
+
+    def __init__(self, node, count, now):
+        self.node = node
+        self.count = count
+        self.now = now
+        self.raw = []
+        self.ticks_per_ms = None
+        self.tick_bits = 24
+        self.events = []
+
+    def finish(self, ticks_per_ms, tick_bits):
+        self.ticks_per_ms = ticks_per_ms
+        self.tick_bits = tick_bits
+        if not self.raw:
+            return
+        wrap = 1 << self.tick_bits
+        # Unwrap forward from the oldest record, then anchor the newest
+        # record against the full tick count sent in the header
+        ticks = [0]
+        for prev, cur in zip(self.raw, self.raw[1:]):
+            ticks.append(ticks[-1] + ((cur[3] - prev[3]) % wrap))
+        newest = self.now - ((self.now - self.raw[-1][3]) % wrap)
+        base = newest - ticks[-1]
+        for (event, arg8, arg16, _), tick in zip(self.raw, ticks):
+            us = (base + tick) * 1000.0 / self.ticks_per_ms
+            self.events.append((us, event, arg8, arg16))
+
+
+def read_dumps(paths, es_type):
+    dumps = []
+    open_dumps = {}
+    for path in paths:
+        for can_id, data in frames(path):
+            if (can_id & (ESC_TYPE_MASK | ESC_RTR_MASK)) != es_type or len(data) < 8:
+                continue
+            if data[0] == TRACE_HEADER:
+                count = data[2] | (data[3] << 8)
+                now = int.from_bytes(data[4:8], 'little')
+                open_dumps[data[1]] = Dump(data[1], count, now)
+            elif data[0] == TRACE_TRAILER:
+                dump = open_dumps.pop(data[1], None)
+                if dump is None:
+                    continue
+                dump.finish(int.from_bytes(data[2:6], 'little'), data[6] or 24)
+                dumps.append(dump)
+            elif data[0] in open_dumps:
+                ticks = data[5] | (data[6] << 8) | (data[7] << 16)
+                open_dumps[data[0]].raw.append((data[1], data[2], data[3] | (data[4] << 8), ticks))
+    for node in open_dumps:
+        sys.stderr.write("node 0x%02x: read out incomplete, ignored\n" % node)
+    return dumps
+
+
+def frame_events(dump, event):
+    found = {}
+    for us, ev, arg8, arg16 in dump.events:
+        if ev == event:
+            found.setdefault((arg16 & 0x7ff, arg8), []).append(us)
+    return found
+
+
+def min_transit(tx_dump, rx_dump):
+    """Smallest rx - tx over frames seen by both, newest frames aligned"""
+    tx = frame_events(tx_dump, TRACE_TX_FRAME)
+    rx = frame_events(rx_dump, TRACE_RX_FRAME)
+    best = None
+    for key, tx_times in tx.items():
+        for t_tx, t_rx in zip(reversed(tx_times), reversed(rx.get(key, []))):
+            diff = t_rx - t_tx
+            if best is None or diff < best:
+                best = diff
+    return best
+
+
+def align(dumps):
+    """Offset to add to each dump's times to put it on the first dump's clock"""
+    offsets = {0: 0.0}
+    pending = [0]
+    while pending:
+        ref = pending.pop()
+        for index, dump in enumerate(dumps):
+            if index in offsets:
+                continue
+            there = min_transit(dumps[ref], dump)
+            back = min_transit(dump, dumps[ref])
+            if there is None and back is None:
+                continue
+            if there is not None and back is not None:
+                # Transit time cancels out when both directions are seen
+                skew = (there - back) / 2.0
+            else:
+                skew = there if there is not None else -back
+            offsets[index] = offsets[ref] - skew
+            pending.append(index)
+    for index, dump in enumerate(dumps):
+        if index not in offsets:
+            sys.stderr.write("node 0x%02x: no frames in common, not aligned\n" % dump.node)
+            offsets[index] = -dump.events[0][0] if dump.events else 0.0
+    return offsets
+
+
+def chrome_trace(dumps, offsets):
+    trace = []
+    for index, dump in enumerate(dumps):
+        pid = index + 1
+        trace.append({"ph": "M", "name": "process_name", "pid": pid, "tid": 0,
+                      "args": {"name": "node 0x%02x" % dump.node}})
+        for us, event, arg8, arg16 in dump.events:
+            name, phase = EVENTS.get(event, ("user 0x%02x" % event, "i"))
+            entry = {"name": name, "ph": phase, "ts": us + offsets[index],
+                     "pid": pid, "tid": 0,
+                     "args": {"arg8": "0x%02x" % arg8, "arg16": "0x%04x" % arg16}}
+            if phase == "i":
+                entry["s"] = "t"
+            trace.append(entry)
+
+    # Flow arrows from each transmission to its receptions
+    flow = 0
+    for index, dump in enumerate(dumps):
+        tx = frame_events(dump, TRACE_TX_FRAME)
+        for other, rx_dump in enumerate(dumps):
+            if other == index:
+                continue
+            rx = frame_events(rx_dump, TRACE_RX_FRAME)
+            for key, tx_times in tx.items():
+                for t_tx, t_rx in zip(reversed(tx_times), reversed(rx.get(key, []))):
+                    flow += 1
+                    trace.append({"name": "frame 0x%03x" % key[0], "cat": "can", "ph": "s",
+                                  "id": flow, "pid": index + 1, "tid": 0,
+                                  "ts": t_tx + offsets[index]})
+                    trace.append({"name": "frame 0x%03x" % key[0], "cat": "can", "ph": "f",
+                                  "bp": "e", "id": flow, "pid": other + 1, "tid": 0,
+                                  "ts": t_rx + offsets[other]})
+    return {"traceEvents": trace, "displayTimeUnit": "ms"}
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    parser.add_argument("logs", nargs="+", help="candump log files")
+    parser.add_argument("-o", "--output", default="-", help="JSON output file")
+    parser.add_argument("--es-type", type=lambda x: int(x, 0), default=ESC_NODE_TRACE,
+                        help="ES Control type of the read out frames")
+    args = parser.parse_args()
+
+    dumps = read_dumps(args.logs, args.es_type)
+    if not dumps:
+        sys.exit("No trace read outs found")
+    result = chrome_trace(dumps, align(dumps))
+    if args.output == "-":
+        json.dump(result, sys.stdout)
+    else:
+        with open(args.output, "w") as out:
+            json.dump(result, out)
+
+
+if __name__ == "__main__":
+    main()